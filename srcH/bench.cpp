@@ -8,14 +8,17 @@
 */
 
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <istream>
+#include <sstream>
 #include <vector>
 
 #include "mixed.h"
 #include "positioning.h"
 #include "searching.h"
 #include "threaded.h"
+#include "transpositiontable.h"
 #include "ucicommand.h"
 
 using namespace std;
@@ -83,8 +86,9 @@ const vector<string> Defaults = {
 /// depth 13), an optional file name where to look for positions in FEN
 /// format (defaults are the positions defined above) and the type of the
 /// limit value: depth (default), time in millisecs or number of nodes.
+/// Returns the total time in millisecs, or 0 if the positions could not be read.
 
-void benchmark(const Position& current, istream& is) {
+TimePoint benchmark(const Position& current, istream& is) {
 
   string token;
   vector<string> fens;
@@ -127,7 +131,7 @@ void benchmark(const Position& current, istream& is) {
       if (!file.is_open())
       {
           cerr << "Unable to open file " << fenFile << endl;
-          return;
+          return 0;
       }
 
       while (getline(file, fen))
@@ -138,6 +142,11 @@ void benchmark(const Position& current, istream& is) {
   }
 
   uint64_t nodes = 0;
+  int64_t mainLatency = 0, allLatency = 0, mainWake = 0, allWake = 0, searches = 0;
+  TTStats ttStats;
+  Search::PruneStats pruneStats;
+  ttStats.clear();
+  pruneStats.clear();
   TimePoint elapsed = now();
   Position pos;
 
@@ -157,6 +166,13 @@ void benchmark(const Position& current, istream& is) {
           Threads.start_thinking(pos, states, limits);
           Threads.main()->wait_for_search_finished();
           nodes += Threads.nodes_searched();
+          ttStats += Threads.tt_stats();
+          pruneStats += Threads.prune_stats();
+          mainLatency += Threads.go_latency(false);
+          allLatency += Threads.go_latency(true);
+          mainWake += Threads.wake_latency(false);
+          allWake += Threads.wake_latency(true);
+          searches++;
       }
   }
 
@@ -167,5 +183,62 @@ void benchmark(const Position& current, istream& is) {
   cerr << "\n==========================="
        << "\nTotal time (ms) : " << elapsed
        << "\nNodes searched  : " << nodes
-       << "\nNodes/second    : " << 1000 * nodes / elapsed << endl;
+       << "\nNodes/second    : " << 1000 * nodes / elapsed;
+
+  // Average time from 'go' to the first node, and to the wake up, of the main
+  // thread and of the last thread to start, in microseconds.
+  if (searches)
+      cerr << "\nGo latency (us) : " << mainLatency / searches
+           << " (all threads " << allLatency / searches << ")"
+           << "\nWake latency(us): " << mainWake / searches
+           << " (all threads " << allWake / searches << ")";
+
+  cerr << "\nHash memory     : " << TT.backing()
+       << "\nHash layout     : " << TT.layout()
+       << "\n" << ttStats << endl;
+
+#ifdef SEARCH_STATS
+  cerr << "\n" << pruneStats << endl;
+#endif
+
+  return elapsed;
+}
+
+
+/// scaling_benchmark() runs benchmark() at a fixed depth with 1, 2, 4... up to
+/// the given number of threads and reports the time to depth of each run and
+/// its speedup over the single threaded one. Parameters are the transposition
+/// table size, the maximum number of threads (default is the current setting),
+/// the depth (default 13) and the positions file, as for benchmark().
+
+void scaling_benchmark(const Position& current, istream& is) {
+
+  string token;
+  string ttSize    = (is >> token) ? token : "16";
+  int maxThreads   = (is >> token) ? stoi(token) : int(Options["Threads"]);
+  string depth     = (is >> token) ? token : "13";
+  string fenFile   = (is >> token) ? token : "default";
+  vector<pair<int, TimePoint>> runs;
+
+  for (int threads = 1; ; threads = min(2 * threads, maxThreads)) // Always finish with maxThreads
+  {
+      istringstream ss(ttSize + " " + to_string(threads) + " " + depth + " " + fenFile);
+      TimePoint elapsed = benchmark(current, ss);
+
+      if (!elapsed)
+          return;
+
+      runs.emplace_back(threads, elapsed);
+
+      if (threads >= maxThreads)
+          break;
+  }
+
+  cerr << "\n==========================="
+       << "\nThreads   Time (ms)   Speedup" << endl;
+
+  for (auto& r : runs)
+      cerr << setw(7) << r.first << setw(12) << r.second
+           << setw(10) << fixed << setprecision(2)
+           << double(runs[0].second) / r.second << endl;
 }
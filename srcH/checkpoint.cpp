@@ -0,0 +1,170 @@
+/*
+  Hypnos, a UCI free chess playing engine 
+  Copyright (C) 2016 MZ
+
+  Hypnos is free of charge. You may use and copy it for private purposes.
+  Hypnos is distributed only in the hope that it will be useful
+  There is no warranty of any kind.
+*/
+
+#include <cstring>   // For std::memcmp
+#include <fstream>
+#include <iostream>
+
+#include "checkpoint.h"
+#include "threaded.h"
+#include "transpositiontable.h"
+#include "ucicommand.h"
+
+/// A checkpoint file stores what a long analysis has learned, so that it can
+/// be resumed later without searching the same tree again. The layout is:
+///
+/// header           magic, format version, entry size and entries per cluster
+/// hash table       see TranspositionTable::dump()
+/// thread tables    thread count, then history, counter moves and counter
+///                  move history of each thread
+/// root moves       root position key, move count, then each move and score
+///
+/// All the numbers are written in the native byte order of the machine, a
+/// checkpoint is meant to be restored on the host where it was taken.
+
+namespace {
+
+  const char Magic[8] = { 'H', 'y', 'p', 'n', 'o', 's', 'C', 'P' };
+  const uint32_t Version = 1;
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entrySize;
+    uint32_t clusterSize;
+    uint32_t reserved;
+  };
+
+  template<typename T> void write(std::ostream& os, const T& v) { os.write((const char*)&v, sizeof(T)); }
+  template<typename T> bool read(std::istream& is, T& v) { return bool(is.read((char*)&v, sizeof(T))); }
+
+  // The thread tables are plain arrays, they are copied byte by byte
+  template<typename T> void write_table(std::ostream& os, const T& t) { write(os, t); }
+  template<typename T> bool read_table(std::istream& is, T* t) { return !t ? bool(is.ignore(sizeof(T))) : read(is, *t); }
+
+} // namespace
+
+
+namespace Checkpoint {
+
+/// save() writes the hash table, the move ordering tables of every thread and
+/// the root moves of the last search to the given file. Returns false on an
+/// I/O error.
+
+bool save(const std::string& fileName) {
+
+  std::ofstream file(fileName, std::ios::out | std::ios::binary | std::ios::trunc);
+
+  if (!file)
+      return false;
+
+  Header h;
+  std::memcpy(h.magic, Magic, sizeof(Magic));
+  h.version = Version;
+  h.entrySize = sizeof(TTEntry);
+  h.clusterSize = TTClusterLayout::Size;
+  h.reserved = 0;
+
+  write(file, h);
+  TT.dump(file);
+
+  write(file, uint32_t(Threads.size()));
+
+  for (Thread* th : Threads)
+  {
+      write_table(file, th->history);
+      write_table(file, th->counterMoves);
+      write_table(file, th->counterMoveHistory);
+  }
+
+  const Search::RootMoves& rootMoves = Threads.main()->rootMoves;
+
+  write(file, Threads.main()->rootPos.key());
+  write(file, uint32_t(rootMoves.size()));
+
+  for (const Search::RootMove& rm : rootMoves)
+  {
+      write(file, uint16_t(rm.pv[0]));
+      write(file, int32_t(rm.score));
+  }
+
+  return bool(file.flush());
+}
+
+
+/// restore() reads a file written by save(). The hash table is resized only
+/// if the entries carry the full key, otherwise the Hash option must match the
+/// checkpoint. Thread tables are restored for as many threads as both the file
+/// and the current pool have, and the root moves ordering is kept aside until
+/// the next search from the same position. Returns false if the file is not a
+/// valid checkpoint for this build.
+
+bool restore(const std::string& fileName) {
+
+  std::ifstream file(fileName, std::ios::in | std::ios::binary);
+  Header h;
+
+  if (   !read(file, h)
+      || std::memcmp(h.magic, Magic, sizeof(Magic))
+      || h.version != Version
+      || h.entrySize != sizeof(TTEntry)
+      || h.clusterSize != uint32_t(TTClusterLayout::Size))
+  {
+      std::cerr << "Not a valid checkpoint: " << fileName << std::endl;
+      return false;
+  }
+
+  if (!TT.load(file))
+  {
+      std::cerr << "Unable to restore the hash table from " << fileName << std::endl;
+      return false;
+  }
+
+  uint32_t threadCount = 0;
+  read(file, threadCount);
+
+  for (uint32_t i = 0; i < threadCount && file; ++i)
+  {
+      Thread* th = i < Threads.size() ? Threads[i] : nullptr;
+
+      read_table(file, th ? &th->history : nullptr);
+      read_table(file, th ? &th->counterMoves : nullptr);
+      read_table(file, th ? &th->counterMoveHistory : nullptr);
+  }
+
+  Key rootKey = 0;
+  uint32_t count = 0;
+  Search::RootMoves rootMoves;
+
+  read(file, rootKey);
+  read(file, count);
+
+  for (uint32_t i = 0; i < count && file; ++i)
+  {
+      uint16_t m;
+      int32_t score;
+
+      if (read(file, m) && read(file, score))
+      {
+          rootMoves.push_back(Search::RootMove(Move(m)));
+          rootMoves.back().score = Value(score);
+      }
+  }
+
+  if (!file)
+  {
+      std::cerr << "Truncated checkpoint: " << fileName << std::endl;
+      return false;
+  }
+
+  Threads.restore_root_moves(rootKey, rootMoves);
+  return true;
+}
+
+} // namespace Checkpoint
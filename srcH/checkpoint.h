@@ -0,0 +1,22 @@
+/*
+  Hypnos, a UCI free chess playing engine 
+  Copyright (C) 2016 MZ
+
+  Hypnos is free of charge. You may use and copy it for private purposes.
+  Hypnos is distributed only in the hope that it will be useful
+  There is no warranty of any kind.
+*/
+
+#ifndef CHECKPOINT_H_INCLUDED
+#define CHECKPOINT_H_INCLUDED
+
+#include <string>
+
+namespace Checkpoint {
+
+bool save(const std::string& fileName);
+bool restore(const std::string& fileName);
+
+}
+
+#endif // #ifndef CHECKPOINT_H_INCLUDED
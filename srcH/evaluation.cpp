@@ -218,6 +218,10 @@ namespace {
   const int BishopCheck       = 538;
   const int KnightCheck       = 874;
 
+  // Lazy evaluation returns early when material, imbalance and pawns are more
+  // than this margin outside the window, the other terms rarely make up for it.
+  const Value LazyMargin = Value(1000);
+
 
   // eval_init() initializes king and attack bitboards for a given color
   // adding pawn attacks. To be done at the beginning of the evaluation.
@@ -807,16 +811,21 @@ namespace {
 
 
 /// evaluate() is the main evaluation function. It returns a static evaluation
-/// of the position from the point of view of the side to move.
+/// of the position from the point of view of the side to move. Given a window,
+/// it may return only the cheap part of the evaluation, when that is already
+/// far enough outside the window for the caller not to need the exact value.
+/// Then 'lazy' is set, as the value is good only for that window.
 
 template<bool DoTrace>
-Value Eval::evaluate(const Position& pos) {
+Value Eval::evaluate(const Position& pos, Value alpha, Value beta, bool& lazy) {
 
   assert(!pos.checkers());
 
   EvalInfo ei;
   Score score;
 
+  lazy = false;
+
   // Initialize score by reading the incrementally updated scores included in
   // the position object (material + piece square tables). Score is computed
   // internally from the white point of view.
@@ -835,6 +844,19 @@ Value Eval::evaluate(const Position& pos) {
   ei.pi = Pawns::probe(pos);
   score += ei.pi->pawns_score() * Weights[PawnStructure];
 
+  // Early exit if the score is far outside the window
+  if (!DoTrace && (alpha > -VALUE_INFINITE || beta < VALUE_INFINITE))
+  {
+      Value v = (mg_value(score) + eg_value(score)) / 2;
+      v = (pos.side_to_move() == WHITE ? v : -v) + Eval::Tempo;
+
+      if (v - LazyMargin >= beta || v + LazyMargin <= alpha)
+      {
+          lazy = true;
+          return v;
+      }
+  }
+
   // Initialize attack and king safety bitboards
   ei.attackedBy[WHITE][ALL_PIECES] = ei.attackedBy[BLACK][ALL_PIECES] = 0;
   ei.attackedBy[WHITE][KING] = pos.attacks_from<KING>(pos.square<KING>(WHITE));
@@ -916,8 +938,8 @@ Value Eval::evaluate(const Position& pos) {
 }
 
 // Explicit template instantiations
-template Value Eval::evaluate<true >(const Position&);
-template Value Eval::evaluate<false>(const Position&);
+template Value Eval::evaluate<true >(const Position&, Value, Value, bool&);
+template Value Eval::evaluate<false>(const Position&, Value, Value, bool&);
 
 
 /// trace() is like evaluate(), but instead of returning a value, it returns
@@ -25,7 +25,13 @@ extern long Optimism[STRATEGY_NB][TERM_NB][COLOR_NB];   // Must be visible to se
 std::string trace(const Position& pos);
 
 template<bool DoTrace = false>
-Value evaluate(const Position& pos);
+Value evaluate(const Position& pos, Value alpha, Value beta, bool& lazy);
+
+template<bool DoTrace = false>
+inline Value evaluate(const Position& pos) { // Full evaluation, without a window
+  bool lazy;
+  return evaluate<DoTrace>(pos, -VALUE_INFINITE, VALUE_INFINITE, lazy);
+}
 }
 
 #endif // #ifndef EVALUTATION_H_INCLUDED
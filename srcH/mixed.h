@@ -19,7 +19,6 @@
 #include "typeskind.h"
 
 const std::string engine_info(bool to_uci = false);
-void prefetch(void* addr);
 void start_logger(bool b);
 
 void dbg_hit_on(bool b);
@@ -34,6 +33,50 @@ inline TimePoint now() {
         (std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
+/// prefetch() preloads the given address in L1/L2 cache. This is a non-blocking
+/// function that doesn't stall the CPU waiting for data to be loaded from memory,
+/// which can be quite slow. It is inline, so that issuing a prefetch costs a
+/// single instruction and several of them can be in flight together.
+#ifdef NO_PREFETCH
+
+inline void prefetch(void*) {}
+
+#else
+
+inline void prefetch(void* addr) {
+
+#  if defined(__INTEL_COMPILER)
+   // This hack prevents prefetches from being optimized away by
+   // Intel compiler. Both MSVC and gcc seem not be affected by this.
+   __asm__ ("");
+#  endif
+
+#  if defined(__INTEL_COMPILER) || defined(_MSC_VER)
+  _mm_prefetch((char*)addr, _MM_HINT_T0);
+#  else
+  __builtin_prefetch(addr);
+#  endif
+}
+
+#endif
+
+/// mul_hi64() returns the upper 64 bits of the 128 bit product a * b. With a
+/// uniformly distributed 'a' it maps it onto [0, b) without any division.
+
+inline uint64_t mul_hi64(uint64_t a, uint64_t b) {
+#if defined(__GNUC__) && defined(IS_64BIT)
+  __extension__ typedef unsigned __int128 uint128;
+  return ((uint128)a * (uint128)b) >> 64;
+#else
+  uint64_t aL = (uint32_t)a, aH = a >> 32;
+  uint64_t bL = (uint32_t)b, bH = b >> 32;
+  uint64_t c1 = (aL * bL) >> 32;
+  uint64_t c2 = aH * bL + c1;
+  uint64_t c3 = aL * bH + (uint32_t)c2;
+  return aH * bH + (c2 >> 32) + (c3 >> 32);
+#endif
+}
+
 template<class Entry, int Size>
 struct HashTable {
   Entry* operator[](Key key) { return &table[(uint32_t)key & (Size - 1)]; }
@@ -35,6 +35,10 @@ struct Stats {
   T* operator[](Piece pc) { return table[pc]; }
   void clear() { std::memset(table, 0, sizeof(table)); }
 
+  // Between two searches the statistics are halved instead of being cleared,
+  // so that what was learnt on the previous move still guides the next one.
+  void age() { for (auto& to : table) for (T& e : to) age(e); }
+
   void update(Piece pc, Square to, Move m) { table[pc][to] = m; }
 
   void update(Piece pc, Square to, Value v) {
@@ -47,6 +51,9 @@ struct Stats {
   }
 
 private:
+  static void age(Value& v) { v = v / 2; }
+  static void age(Stats<Value, true>& s) { s.age(); }
+
   T table[PIECE_NB][SQUARE_NB];
 };
 
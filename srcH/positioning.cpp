@@ -34,6 +34,16 @@ namespace Zobrist {
 
 namespace {
 
+// Cuckoo tables with the Zobrist key differences of all the reversible moves,
+// that is the moves of a non pawn piece between two squares, in both colors.
+// A key difference is stored in one of two slots, given by H1() and H2(),
+// together with the move, see has_game_cycle().
+Key Cuckoo[8192];
+Move CuckooMove[8192];
+
+inline int H1(Key h) { return h & 0x1fff; }
+inline int H2(Key h) { return (h >> 16) & 0x1fff; }
+
 const string PieceToChar(" PNBRQK  pnbrqk");
 
 // min_attacker() is a helper function used by see() to locate the least
@@ -138,6 +148,38 @@ void Position::init() {
   }
 
   Zobrist::side = rng.rand<Key>();
+
+  // Prepare the cuckoo tables
+  std::memset(Cuckoo, 0, sizeof(Cuckoo));
+  std::memset(CuckooMove, 0, sizeof(CuckooMove));
+  int count = 0;
+
+  for (Color c = WHITE; c <= BLACK; ++c)
+      for (PieceType pt = KNIGHT; pt <= KING; ++pt)
+          for (Square s1 = SQ_A1; s1 <= SQ_H8; ++s1)
+              for (Square s2 = Square(s1 + 1); s2 <= SQ_H8; ++s2)
+                  if ((pt == KNIGHT || pt == KING ? StepAttacksBB[pt][s1]
+                                                  : PseudoAttacks[pt][s1]) & s2)
+                  {
+                      Move move = make_move(s1, s2);
+                      Key key = Zobrist::psq[c][pt][s1] ^ Zobrist::psq[c][pt][s2] ^ Zobrist::side;
+                      int i = H1(key);
+
+                      while (true)
+                      {
+                          std::swap(Cuckoo[i], key);
+                          std::swap(CuckooMove[i], move);
+
+                          if (move == MOVE_NONE) // Arrived at empty slot?
+                              break;
+
+                          i = (i == H1(key)) ? H2(key) : H1(key); // Push victim to alternative slot
+                      }
+
+                      count++;
+                  }
+
+  assert(count == 3668);
 }
 
 
@@ -256,6 +298,42 @@ Position& Position::set(const string& fenStr, bool isChess960, StateInfo* si, Th
   chess960 = isChess960;
   thisThread = th;
   set_state(st);
+  keyRing[ringIdx = 0] = st->key;
+
+  assert(pos_is_ok());
+
+  return *this;
+}
+
+
+/// Position::set() copies the given position, a cheaper way than a FEN round
+/// trip to give each search thread its own root. The current state is copied
+/// into 'si', that keeps the link to the previous states, and the position is
+/// bound to thread 'th'. The node counter is not touched, as other threads may
+/// be reading it: it is reset by the caller before the search starts.
+
+Position& Position::set(const Position& pos, StateInfo* si, Thread* th) {
+
+  std::memcpy(board, pos.board, sizeof(board));
+  std::memcpy(byTypeBB, pos.byTypeBB, sizeof(byTypeBB));
+  std::memcpy(byColorBB, pos.byColorBB, sizeof(byColorBB));
+  std::memcpy(pieceCount, pos.pieceCount, sizeof(pieceCount));
+  std::memcpy(pieceList, pos.pieceList, sizeof(pieceList));
+  std::memcpy(index, pos.index, sizeof(index));
+  std::memcpy(castlingRightsMask, pos.castlingRightsMask, sizeof(castlingRightsMask));
+  std::memcpy(castlingRookSquare, pos.castlingRookSquare, sizeof(castlingRookSquare));
+  std::memcpy(castlingPath, pos.castlingPath, sizeof(castlingPath));
+  std::memcpy(keyRing, pos.keyRing, sizeof(keyRing));
+  gamePly = pos.gamePly;
+  sideToMove = pos.sideToMove;
+  chess960 = pos.chess960;
+  ringIdx = pos.ringIdx;
+
+  if (si != pos.st)
+      *si = *pos.st;
+
+  st = si;
+  thisThread = th;
 
   assert(pos_is_ok());
 
@@ -780,6 +858,7 @@ void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
 
   // Update the key with the final value
   st->key = k;
+  keyRing[++ringIdx & (KeyRingSize - 1)] = k;
 
   // Calculate checkers bitboard (if move gives check)
   st->checkersBB = givesCheck ? attackers_to(square<KING>(them)) & pieces(us) : 0;
@@ -849,6 +928,7 @@ void Position::undo_move(Move m) {
   // Finally point our state pointer back to the previous state
   st = st->previous;
   --gamePly;
+  --ringIdx;
 
   assert(pos_is_ok());
 }
@@ -892,6 +972,7 @@ void Position::do_null_move(StateInfo& newSt) {
   }
 
   st->key ^= Zobrist::side;
+  keyRing[++ringIdx & (KeyRingSize - 1)] = st->key;
   prefetch(TT.first_entry(st->key));
 
   ++st->rule50;
@@ -908,6 +989,7 @@ void Position::undo_null_move() {
 
   st = st->previous;
   sideToMove = ~sideToMove;
+  --ringIdx;
 }
 
 
@@ -931,6 +1013,36 @@ Key Position::key_after(Move m) const {
 }
 
 
+/// Position::key_after() with pawn and material keys also computes the pawn and
+/// material hash keys after the given move, so that the pawn and material hash
+/// table slots of the child can be prefetched together with its TT cluster.
+/// Like the plain version it doesn't recognize special moves.
+
+Key Position::key_after(Move m, Key& pawnKey, Key& materialKey) const {
+
+  Color us = sideToMove;
+  Square from = from_sq(m);
+  Square to = to_sq(m);
+  PieceType captured = type_of(piece_on(to));
+
+  pawnKey = st->pawnKey;
+  materialKey = st->materialKey;
+
+  if (captured)
+  {
+      materialKey ^= Zobrist::psq[~us][captured][pieceCount[~us][captured] - 1];
+
+      if (captured == PAWN)
+          pawnKey ^= Zobrist::psq[~us][PAWN][to];
+  }
+
+  if (type_of(piece_on(from)) == PAWN)
+      pawnKey ^= Zobrist::psq[us][PAWN][from] ^ Zobrist::psq[us][PAWN][to];
+
+  return key_after(m);
+}
+
+
 /// Position::see() is a static exchange evaluator: It tries to estimate the
 /// material gain or loss resulting from a move.
 
@@ -1018,20 +1130,69 @@ Value Position::see(Move m) const {
 
 
 /// Position::is_draw() tests whether the position is drawn by 50-move rule
-/// or by repetition. It does not detect stalemates.
+/// or by repetition. It does not detect stalemates. The keys of the previous
+/// positions are read from the ring, not from the chain of StateInfo.
 
 bool Position::is_draw() const {
 
   if (st->rule50 > 99 && (!checkers() || MoveList<LEGAL>(*this).size()))
       return true;
 
-  StateInfo* stp = st;
-  for (int i = 2, e = std::min(st->rule50, st->pliesFromNull); i <= e; i += 2)
-  {
-      stp = stp->previous->previous;
+  int end = std::min(std::min(st->rule50, st->pliesFromNull), KeyRingSize - 1);
 
-      if (stp->key == st->key)
+  for (int i = 2; i <= end; i += 2)
+      if (ring_key(i) == st->key)
           return true; // Draw at first repetition
+
+  return false;
+}
+
+
+/// Position::has_game_cycle() tests if the position has a move which draws by
+/// repetition, or an earlier position has a move that directly reaches the
+/// current position. The key difference with each earlier position, where the
+/// same side is to move, is looked up in the cuckoo tables: a hit is a single
+/// reversible move, which is possible if the squares between are empty. Cycles
+/// that reach back before the root must also have been repeated once, for the
+/// draw to be certain.
+
+bool Position::has_game_cycle(int ply) const {
+
+  int j;
+  int end = std::min(std::min(st->rule50, st->pliesFromNull), KeyRingSize - 1);
+
+  if (end < 3)
+      return false;
+
+  Key originalKey = st->key;
+
+  for (int i = 3; i <= end; i += 2)
+  {
+      Key otherKey = ring_key(i);
+      Key moveKey = originalKey ^ otherKey;
+
+      if (   (j = H1(moveKey), Cuckoo[j] == moveKey)
+          || (j = H2(moveKey), Cuckoo[j] == moveKey))
+      {
+          Move move = CuckooMove[j];
+          Square s1 = from_sq(move);
+          Square s2 = to_sq(move);
+
+          if (!(between_bb(s1, s2) & pieces()))
+          {
+              if (ply > i)
+                  return true;
+
+              // Before the root, check that the move is one of the side to
+              // move, i.e. that it repeats, rather than reaches, this position.
+              if (color_of(piece_on(empty(s1) ? s2 : s1)) != side_to_move())
+                  continue;
+
+              for (int k = i + 2; k <= end; k += 2)
+                  if (ring_key(k) == otherKey)
+                      return true;
+          }
+      }
   }
 
   return false;
@@ -87,6 +87,7 @@ public:
 
   // FEN string input/output
   Position& set(const std::string& fenStr, bool isChess960, StateInfo* si, Thread* th);
+  Position& set(const Position& pos, StateInfo* si, Thread* th);
   const std::string fen() const;
 
   // Position representation
@@ -149,6 +150,7 @@ public:
   // Accessing hash keys
   Key key() const;
   Key key_after(Move m) const;
+  Key key_after(Move m, Key& pawnKey, Key& materialKey) const;
   Key material_key() const;
   Key pawn_key() const;
 
@@ -161,6 +163,7 @@ public:
   uint64_t nodes_searched() const;
   void set_nodes_searched(uint64_t n);
   bool is_draw() const;
+  bool has_game_cycle(int ply) const;
   int rule50_count() const;
   Score psq_score() const;
   Value non_pawn_material(Color c) const;
@@ -170,6 +173,11 @@ public:
   void flip();
 
 private:
+  // Keys of the last positions, indexed by ringIdx, see is_draw()
+  static const int KeyRingSize = 256;
+
+  Key ring_key(int plies) const { return keyRing[(ringIdx - plies) & (KeyRingSize - 1)]; }
+
   // Initialization helpers (used while setting up a position)
   void set_castling_right(Color c, Square rfrom);
   void set_state(StateInfo* si) const;
@@ -198,6 +206,8 @@ private:
   Thread* thisThread;
   StateInfo* st;
   bool chess960;
+  int ringIdx;
+  Key keyRing[KeyRingSize];
 };
 
 extern std::ostream& operator<<(std::ostream& os, const Position& pos);
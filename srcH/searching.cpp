@@ -11,6 +11,7 @@
 #include <cassert>
 #include <cmath>
 #include <cstring>   // For std::memset
+#include <iomanip>
 #include <iostream>
 #include <sstream>
 
@@ -50,6 +51,19 @@ using Eval::Optimism;
 using Eval::rootColor;
 using namespace Search;
 
+// PRUNE_STAT counts an outcome of a pruning step, see PruneStats
+#ifdef SEARCH_STATS
+#define PRUNE_STAT(step, depth, outcome) PruneStats::local.hit(PruneStats::step, depth, PruneStats::outcome)
+#define PRUNE_NODE(depth) PruneStats::local.node(depth)
+#define PRUNE_ITERATION(depth, nodes) PruneStats::local.iteration(depth, nodes)
+#else
+#define PRUNE_STAT(step, depth, outcome) (void)0
+#define PRUNE_NODE(depth) (void)0
+#define PRUNE_ITERATION(depth, nodes) (void)0
+#endif
+
+thread_local PruneStats PruneStats::local;
+
 namespace {
   // Different node types, used as a template parameter
   enum NodeType { NonPV, PV };
@@ -66,6 +80,45 @@ namespace {
     return Reductions[PvNode][i][std::min(d, 63 * ONE_PLY)][std::min(mn, 63)];
   }
 
+  // prefetch_after() prefetches the TT cluster of the position after the move
+  // and, when the move changes them, its pawn and material hash table slots,
+  // so that the loads overlap with the legality checks and do_move(). With
+  // 'qsTier' the cluster is taken from the thread's QSTable.
+  void prefetch_after(const Position& pos, Move move, bool qsTier = false) {
+
+    Key pawnKey, materialKey;
+    Thread* thisThread = pos.this_thread();
+    Key key = pos.key_after(move, pawnKey, materialKey);
+
+    prefetch(qsTier ? thisThread->qsTable.first_entry(key) : TT.first_entry(key));
+
+    if (pawnKey != pos.pawn_key())
+        prefetch(thisThread->pawnsTable[pawnKey]);
+
+    if (materialKey != pos.material_key())
+        prefetch(thisThread->materialTable[materialKey]);
+  }
+
+  // lazy_evaluate() evaluates with the window of a non-PV node and counts the
+  // evaluations that exit early, in which case 'lazy' is set.
+  Value lazy_evaluate(const Position& pos, Value alpha, Value beta, Depth depth, bool& lazy) {
+
+    Value v = evaluate(pos, alpha, beta, lazy);
+
+    (void)depth; // Only used by the counters
+    PRUNE_STAT(LAZY_EVAL, depth, ATTEMPT);
+    if (lazy)
+        PRUNE_STAT(LAZY_EVAL, depth, CUTOFF);
+
+    return v;
+  }
+
+  // Spread a move over all the key bits. The TT cluster is picked from the high
+  // bits of the key, and excluded move entries must not crowd the same cluster.
+  Key make_key(uint64_t seed) {
+    return seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  }
+
   // Skill structure is used to implement strength limit
   struct Skill {
     Skill(int l) : level(l) {}
@@ -92,7 +145,7 @@ namespace {
       return expectedPosKey == key ? pv[2] : MOVE_NONE;
     }
 
-    void update(Position& pos, const std::vector<Move>& newPv) {
+    void update(Position& pos, const PVLine& newPv) {
 
       assert(newPv.size() >= 3);
 
@@ -117,37 +170,234 @@ namespace {
     Move pv[3];
   };
 
-  // Set of rows with half bits set to 1 and half to 0. It is used to allocate
-  // the search depths across the threads.
-  typedef std::vector<int> Row;
-
-  const Row HalfDensity[] = {
-    {0, 1},
-    {1, 0},
-    {0, 0, 1, 1},
-    {0, 1, 1, 0},
-    {1, 1, 0, 0},
-    {1, 0, 0, 1},
-    {0, 0, 0, 1, 1, 1},
-    {0, 0, 1, 1, 1, 0},
-    {0, 1, 1, 1, 0, 0},
-    {1, 1, 1, 0, 0, 0},
-    {1, 1, 0, 0, 0, 1},
-    {1, 0, 0, 0, 1, 1},
-    {0, 0, 0, 0, 1, 1, 1, 1},
-    {0, 0, 0, 1, 1, 1, 1, 0},
-    {0, 0, 1, 1, 1, 1, 0 ,0},
-    {0, 1, 1, 1, 1, 0, 0 ,0},
-    {1, 1, 1, 1, 0, 0, 0 ,0},
-    {1, 1, 1, 0, 0, 0, 0 ,1},
-    {1, 1, 0, 0, 0, 0, 1 ,1},
-    {1, 0, 0, 0, 0, 1, 1 ,1},
+  // Helper threads skip some iterations so that they search different depths
+  // than the main thread and each other. Helper i gets a row of a generated
+  // matrix: the first 2 helpers get the rotations of a row of period 2, the
+  // next 4 the rotations of a row of period 4 and so on, so that every helper
+  // has its own pattern whatever the number of threads. A row of period p has
+  // its last p * skipRate / 100 bits set, with the default 50 giving the former
+  // half-density matrix. At least one bit is left clear, otherwise high rates
+  // would round up to a row that skips every iteration.
+  bool skip_iteration(size_t idx, int ply, int skipRate) {
+
+    int row = int(idx - 1), period = 2;
+
+    while (row >= period)
+        row -= period, period += 2;
+
+    int skipped = std::min((period * skipRate + 50) / 100, period - 1);
+    return (ply + row) % period >= period - skipped;
+  }
+
+  // BusyTable keeps the (position, move) pairs that some thread is searching
+  // right now, in the spirit of ABDADA. A thread finding a move busy defers it
+  // to the end of its move loop, when the result will likely be in TT. Slots
+  // are overwritten without locks: a lost or stale mark only makes a thread
+  // defer a move less or more often than needed.
+  struct BusyTable {
+
+    static const int Size = 1 << 14;
+    static const int MinDepth = 4; // In plies, not worth it below
+
+    bool busy(Key k) const { return slots[k & (Size - 1)].load(std::memory_order_relaxed) == k; }
+    void mark(Key k) { slots[k & (Size - 1)].store(k, std::memory_order_relaxed); }
+
+    void unmark(Key k) {
+      Key expected = k; // Leave the slot alone if another pair took it
+      slots[k & (Size - 1)].compare_exchange_strong(expected, 0, std::memory_order_relaxed);
+    }
+
+    std::atomic<Key> slots[Size];
   };
 
-  const size_t HalfDensitySize = std::extent<decltype(HalfDensity)>::value;
+  // SplitPV distributes the lines of a MultiPV search across the threads: with
+  // 'groups' groups, thread idx searches the lines l with l % groups equal to
+  // idx % groups and publishes each completed line here. At the end of every
+  // iteration the main thread merges the published lines into a single root
+  // move order that all the threads pick up before their next iteration.
+  struct SplitPV {
+
+    void init(size_t multiPV, size_t g) {
+      groups = g;
+      fresh = 0;
+      merged.clear();
+      lines.assign(multiPV, RootMove(MOVE_NONE));
+    }
+
+    // Each line keeps the depth it was searched at, which is the depth reported
+    // for it, as the groups do not complete their iterations together.
+    void publish(const RootMove& rm, size_t line, Depth depth) {
+      std::lock_guard<Mutex> lk(mutex);
+
+      if (depth > lines[line].depth)
+          lines[line] = rm, lines[line].depth = depth;
+    }
+
+    void pick_up(RootMoves& rootMoves) {
+      std::lock_guard<Mutex> lk(mutex);
+
+      if (!merged.empty())
+          rootMoves = merged;
+    }
+
+    // Published lines come first, in line order and dropping a move already
+    // taken by a better line. The lines are not sorted by score, as they may
+    // come from different depths, so the first move is always the deepest
+    // result of line 0, the one reported as 'multipv 1' and played. A line may
+    // have picked a move taken by another one, because it excluded the better
+    // moves of an older merge, so the published lines of the previous merge
+    // fill the gaps for one more merge. Then come the remaining moves in the
+    // current order, which are not reported.
+    void merge(RootMoves& rootMoves) {
+      std::lock_guard<Mutex> lk(mutex);
+
+      RootMoves previous;
+      std::swap(previous, merged);
+      size_t previousFresh = fresh;
+
+      for (size_t l = 0; l < lines.size(); ++l)
+          if (lines[l].depth && !std::count(merged.begin(), merged.end(), lines[l].pv[0]))
+              merged.push_back(lines[l]);
+
+      fresh = merged.size();
+
+      for (size_t i = 0; i < previousFresh; ++i)
+          if (!std::count(merged.begin(), merged.end(), previous[i].pv[0]))
+              merged.push_back(previous[i]);
+
+      size_t top = merged.size();
+      for (const RootMove& rm : rootMoves)
+          if (!std::count(merged.begin(), merged.begin() + top, rm.pv[0]))
+          {
+              merged.push_back(rm);
+              merged.back().depth = DEPTH_ZERO;
+          }
+
+      rootMoves = merged;
+    }
+
+    Mutex mutex;
+    RootMoves merged;
+    std::vector<RootMove> lines;
+    size_t fresh;  // Leading entries of merged taken from the lines
+    size_t groups; // Zero when the lines are not split
+  };
+
+  // SyncPoint is where the threads meet between two iterations in deterministic
+  // mode. When all of them have arrived, the last one checks the node budget,
+  // then each thread merges its own slice of TT from the buffers of all the
+  // threads, and clears its buffer once all the slices are done. A thread
+  // waiting for the others leaves when the search is stopped, leaving its
+  // buffer to merge() at the end of the search.
+  struct SyncPoint {
+
+    void init(size_t n) {
+      count = n;
+      arrived = 0;
+      phase = 0;
+      buffers.clear();
+      for (Thread* th : Threads)
+          buffers.push_back(&th->syncBuffer);
+    }
+
+    // Returns false if the search has been stopped
+    bool wait(size_t idx) {
+
+      if (!barrier(true))
+          return false;
+
+      merge(idx);
+
+      if (!barrier(false))
+          return false;
+
+      buffers[idx]->clear();
+      return !Signals.stop;
+    }
+
+    void merge(size_t idx) { TT.merge(buffers, idx, count); }
+
+    // Returns false if the search is stopped before all the threads arrive
+    bool barrier(bool checkNodes) {
+      int p = phase;
+
+      if (++arrived == count)
+      {
+          if (checkNodes && Limits.nodes && Threads.nodes_searched() >= Limits.nodes)
+              Signals.stop = true;
+
+          arrived = 0;
+          ++phase;
+          return true;
+      }
+
+      while (phase == p)
+          if (Signals.stop)
+              return false;
+          else
+              std::this_thread::yield();
+
+      return true;
+    }
+
+    size_t count;
+    std::atomic<size_t> arrived;
+    std::atomic<int> phase;
+    std::vector<QSTable*> buffers;
+  };
+
+  // EffortTable counts the nodes spent under each root move by all the threads,
+  // indexed by the from and to squares of the move. The main thread takes a
+  // snapshot at the end of each iteration, to know where the effort of the
+  // iteration went.
+  struct EffortTable {
+
+    void clear() {
+      for (auto& n : nodes)
+          n = 0;
+      std::memset(last, 0, sizeof(last));
+    }
+
+    void add(Move m, uint64_t n) { nodes[m & 0xFFF].fetch_add(n, std::memory_order_relaxed); }
 
+    // Updates the effort of the root moves and returns the share of the nodes
+    // searched since the previous call that went to the best move.
+    double update(RootMoves& rootMoves) {
+
+      uint64_t total = 0, best = 0;
+
+      for (RootMove& rm : rootMoves)
+      {
+          int i = rm.pv[0] & 0xFFF;
+          rm.effort = nodes[i].load(std::memory_order_relaxed);
+          total += rm.effort - last[i];
+          best = &rm == &rootMoves[0] ? rm.effort - last[i] : best;
+          last[i] = rm.effort;
+      }
+
+      return total ? double(best) / total : 1.0;
+    }
+
+    std::atomic<uint64_t> nodes[1 << 12];
+    uint64_t last[1 << 12];
+  };
+
+  SplitPV Split;
+  SyncPoint Sync;
+  EffortTable Effort;
+  BusyTable Busy;
   EasyMoveManager EasyMove;
   Value DrawValue[COLOR_NB];
+  bool QSTier; // Quiescence entries go to the per thread QSTable
+  int SkipRate; // Percentage of the iterations skipped by helper threads
+  bool Deterministic; // Threads write to their sync buffer and sync between iterations
+
+  // probe_tt() looks up TT. In deterministic mode the entries written during an
+  // iteration go to the thread's sync buffer, and reach TT at the sync point.
+  TTEntry* probe_tt(const Position& pos, Key key, bool& found, TTEntry& ttData) {
+    return Deterministic ? TT.probe_buffered(pos.this_thread()->syncBuffer, key, found, ttData)
+                         : TT.probe(key, found, ttData);
+  }
 
   template <NodeType NT>
   Value search(Position& pos, Stack* ss, Value alpha, Value beta, Depth depth, bool cutNode);
@@ -155,12 +405,84 @@ namespace {
   template <NodeType NT, bool InCheck>
   Value qsearch(Position& pos, Stack* ss, Value alpha, Value beta, Depth depth);
 
-  Value value_to_tt(Value v, int ply);
-  Value value_from_tt(Value v, int ply);
   void update_pv(Move* pv, Move move, Move* childPv);
   void update_stats(const Position& pos, Stack* ss, Move move, Depth depth, Move* quiets, int quietsCnt);
   void check_time();
 
+  // Timer raises Signals.stop when the time or the node budget of the search
+  // runs out, so that the search threads only have to read the flag. It sleeps
+  // until the deadline, but wakes up every millisecond when it has to watch
+  // something else than the clock: a node budget, the 'nodes as time' mode or
+  // a ponder search, that "ponderhit" turns into a timed one. Anyway it wakes
+  // up every second, for check_time() to call dbg_print().
+  class Timer {
+
+  public:
+    void start() {
+      exit = false;
+      nativeThread = std::thread(&Timer::loop, this);
+    }
+
+    void stop() {
+      {
+          std::unique_lock<Mutex> lk(mutex);
+          exit = true;
+      }
+      sleepCondition.notify_one();
+      nativeThread.join();
+    }
+
+  private:
+    void loop() {
+
+      std::unique_lock<Mutex> lk(mutex);
+
+      while (!exit)
+      {
+          check_time();
+
+          TimePoint sleep = 1;
+
+          if (!Limits.nodes && !Limits.npmsec && !Limits.ponder)
+          {
+              int elapsed = Time.elapsed();
+              TimePoint left =  Limits.movetime ? Limits.movetime - elapsed
+                              : Limits.use_time_management() ? Time.maximum() - 10 - elapsed : 1000;
+
+              sleep = std::max(TimePoint(1), std::min(left, TimePoint(1000)));
+          }
+
+          sleepCondition.wait_for(lk, std::chrono::milliseconds(sleep));
+      }
+    }
+
+    Mutex mutex;
+    ConditionVariable sleepCondition;
+    std::thread nativeThread;
+    bool exit;
+  };
+
+  Timer SearchTimer;
+
+  // The 'info' lines of UCI::pv() are built in a buffer reserved at startup,
+  // that keeps its capacity from one call to the next, so that printing the
+  // PV does not allocate once the buffer has grown to the longest output.
+  // Only the main thread prints the PV.
+  std::string PVBuffer;
+
+  void append(std::string& s, int64_t n) {
+
+    char buf[24], *p = buf + sizeof(buf);
+    uint64_t u = n < 0 ? 0 - uint64_t(n) : uint64_t(n);
+
+    do *--p = char('0' + u % 10); while (u /= 10);
+
+    if (n < 0)
+        *--p = '-';
+
+    s.append(p, buf + sizeof(buf) - p);
+  }
+
 } // namespace
 
 
@@ -189,23 +511,37 @@ void Search::init() {
       FutilityMoveCounts[0][d] = int(2.4 + 0.773 * pow(d + 0.00, 1.8));
       FutilityMoveCounts[1][d] = int(2.9 + 1.045 * pow(d + 0.49, 1.8));
   }
+
+  PVBuffer.reserve(1 << 16);
 }
 
 
-/// Search::clear() resets search state to zero, to obtain reproducible results
+/// Search::clear() resets search state to zero, to obtain reproducible results.
+/// With 'lazyHash' the hash table only starts a new game, in constant time, and
+/// its old entries are erased by the search as it meets them.
 
-void Search::clear() {
+void Search::clear(bool lazyHash) {
 
-  TT.clear();
+  // A shared table holds the work of other processes too, it is never cleared
+  if (!TT.shared())
+  {
+      if (lazyHash)
+          TT.new_game();
+      else
+          TT.clear();
+  }
 
   for (Thread* th : Threads)
   {
       th->history.clear();
       th->counterMoves.clear();
+      th->qsTable.clear();
+      th->syncBuffer.clear();
 	  th->counterMoveHistory.clear();
   }
 
   Threads.main()->previousScore = VALUE_INFINITE;
+  Threads.main()->predictedKey = 0;
 }
 
 
@@ -252,6 +588,21 @@ void MainThread::search() {
   DrawValue[ us] = VALUE_DRAW - Value(contempt);
   DrawValue[~us] = VALUE_DRAW + Value(contempt);
 
+  SkipRate = Options["Helper Skip Rate"];
+
+  // In deterministic mode each thread buffers its TT writes in its sync buffer,
+  // sized after its share of the hash, so that the search of a thread does not
+  // depend on how far the others are. It needs the full key to merge entries.
+  Deterministic = Options["Deterministic SMP"] && Threads.size() > 1 && TTEntry::FullKey;
+  QSTier = Options["QSearch Hash"] && !Deterministic;
+
+  int bufferBits = Deterministic ? QSTable::DefaultBits + std::min(6, int(msb(std::max(int(Options["Hash"]) / int(Threads.size()), 1))))
+                                 : 0;
+  for (Thread* th : Threads)
+      th->syncBuffer.resize(bufferBits);
+
+  Sync.init(Threads.size());
+
   rootColor = rootPos.side_to_move();
 
   std::memset(Optimism, 0, sizeof(Optimism));
@@ -275,6 +626,8 @@ void MainThread::search() {
   Optimism[LOSING][MOBILITY][~us] =   0;   // if negative : take less care of opponent mobility
 
 
+  SearchTimer.start();
+
   if (rootMoves.empty())
   {
       rootMoves.push_back(RootMove(MOVE_NONE));
@@ -295,6 +648,18 @@ void MainThread::search() {
           }
       }
 
+      // With 'MultiPV Split' each PV line is searched by its own group of
+      // threads instead of all the threads searching all the lines in turn.
+      size_t multiPV = std::min((size_t)Options["MultiPV"], rootMoves.size());
+      size_t groups = Options["MultiPV Split"] && multiPV > 1 && Threads.size() > 1 && !Deterministic
+                     ? std::min(multiPV, Threads.size()) : 0;
+
+      Split.init(multiPV, groups);
+
+      // Before the helpers start, so that all the threads see the same generation
+      TT.new_search();
+      Effort.clear();
+
       for (Thread* th : Threads)
           if (th != this)
               th->start_searching();
@@ -321,12 +686,20 @@ finalize:
 
   // Stop the threads if not already stopped
   Signals.stop = true;
+  SearchTimer.stop();
 
   // Wait until all threads have finished
   for (Thread* th : Threads)
       if (th != this)
           th->wait_for_search_finished();
 
+  // Merge what a stop left buffered since the last sync point, on all the threads
+  if (Deterministic)
+  {
+      Threads.execute([](size_t i) { Sync.merge(i); }, this);
+      Threads.execute([](size_t i) { Threads[i]->syncBuffer.clear(); }, this);
+  }
+
   // Check if there are threads with a better score than main thread
   Thread* bestThread = this;
   if (   !this->easyMovePlayed
@@ -343,6 +716,32 @@ finalize:
 
   previousScore = bestThread->rootMoves[0].score;
 
+  // Remember the position expected after our move and the predicted reply, so
+  // that the next search can go on from this one (see ThreadPool::start_thinking).
+  const PVLine& bestPV = bestThread->rootMoves[0].pv;
+  predictedKey = 0;
+
+  if (bestPV.size() > 2)
+  {
+      StateInfo st[3];
+      Position pos;
+      pos.set(rootPos, &st[0], this);
+      pos.do_move(bestPV[0], st[1], pos.gives_check(bestPV[0], CheckInfo(pos)));
+      pos.do_move(bestPV[1], st[2], pos.gives_check(bestPV[1], CheckInfo(pos)));
+
+      predictedKey = pos.key();
+      predictedMove = bestPV[2];
+      predictedDepth = bestThread->completedDepth;
+  }
+
+  // Age the history tables for the next search now, rather than delay its
+  // start. Before the bestmove, after which the GUI may send commands that
+  // need the threads.
+  Threads.execute([](size_t i) {
+      Threads[i]->history.age();
+      Threads[i]->counterMoveHistory.age();
+  }, this);
+
   // Send new PV when needed
   if (bestThread != this)
       sync_cout << UCI::pv(bestThread->rootPos, bestThread->completedDepth, -VALUE_INFINITE, VALUE_INFINITE) << sync_endl;
@@ -379,7 +778,6 @@ void Thread::search() {
       EasyMove.clear();
       mainThread->easyMovePlayed = mainThread->failedLow = false;
       mainThread->bestMoveChanges = 0;
-      TT.new_search();
   }
 
   size_t multiPV = Options["MultiPV"];
@@ -392,17 +790,32 @@ void Thread::search() {
 
   multiPV = std::min(multiPV, rootMoves.size());
 
+  // When the PV lines are split this thread searches only the lines of its
+  // group, and the helpers which are alone in their group do not skip depths.
+  size_t firstPV = Split.groups ? idx % Split.groups : 0;
+  size_t stepPV  = Split.groups ? Split.groups : 1;
+  bool maySkip = !Split.groups || idx >= Split.groups;
+  bool leftSync = false; // A sync point was left on a stop
+
+  goLatency = std::chrono::duration_cast<std::chrono::microseconds>(
+                  std::chrono::steady_clock::now() - Threads.goTime).count();
+
   // Iterative deepening loop until requested to stop or the target depth is reached.
-  while (++rootDepth < DEPTH_MAX && !Signals.stop && (!Limits.depth || Threads.main()->rootDepth <= Limits.depth))
+  while (   ++rootDepth < DEPTH_MAX && !Signals.stop
+         && (!Limits.depth || (Deterministic ? rootDepth : Threads.main()->rootDepth) <= Limits.depth))
   {
-      // Set up the new depths for the helper threads skipping on average every
-      // 2nd ply (using a half-density matrix).
-      if (!mainThread)
-      {
-          const Row& row = HalfDensity[(idx - 1) % HalfDensitySize];
-          if (row[(rootDepth + rootPos.game_ply()) % row.size()])
-             continue;
-      }
+      // In deterministic mode all the threads start each iteration together,
+      // after the entries of the previous one have been merged into TT.
+      if (Deterministic && rootDepth > ONE_PLY && (leftSync = !Sync.wait(idx)))
+          break;
+
+      // Set up the new depths for the helper threads skipping on average one
+      // ply in 100 / SkipRate (using a generated matrix, one row per helper).
+      if (!mainThread && maySkip && skip_iteration(idx, rootDepth + rootPos.game_ply(), SkipRate))
+          continue;
+
+      if (Split.groups)
+          Split.pick_up(rootMoves);
 
       // Age out PV variability metric
       if (mainThread)
@@ -414,7 +827,7 @@ void Thread::search() {
           rm.previousScore = rm.score;
 
       // MultiPV loop. We perform a full root search for each PV line
-      for (PVIdx = 0; PVIdx < multiPV && !Signals.stop; ++PVIdx)
+      for (PVIdx = firstPV; PVIdx < multiPV && !Signals.stop; PVIdx += stepPV)
       {
           // Reset aspiration window starting size
           if (rootDepth >= 5 * ONE_PLY)
@@ -479,6 +892,14 @@ void Thread::search() {
               assert(alpha >= -VALUE_INFINITE && beta <= VALUE_INFINITE);
           }
 
+          if (Split.groups)
+          {
+              if (!Signals.stop)
+                  Split.publish(rootMoves[PVIdx], PVIdx, rootDepth);
+
+              continue; // The main thread reports after the merge
+          }
+
           // Sort the PV lines searched so far and update the GUI
           std::stable_sort(rootMoves.begin(), rootMoves.begin() + PVIdx + 1);
 
@@ -494,11 +915,27 @@ void Thread::search() {
       }
 
       if (!Signals.stop)
+      {
           completedDepth = rootDepth;
+          PRUNE_ITERATION(rootDepth, rootPos.nodes_searched());
+      }
 
       if (!mainThread)
           continue;
 
+      if (Split.groups)
+      {
+          Split.merge(rootMoves);
+          bestValue = rootMoves[0].score;
+          PVIdx = multiPV - 1; // All the lines are reported as updated
+
+          if (Signals.stop)
+              sync_cout << "info nodes " << Threads.nodes_searched()
+                        << " time " << Time.elapsed() << sync_endl;
+          else
+              sync_cout << UCI::pv(rootPos, rootDepth, -VALUE_INFINITE, VALUE_INFINITE) << sync_endl;
+      }
+
       // If skill level is enabled and time is up, pick a sub-optimal best move
       if (skill.enabled() && skill.time_to_pick(rootDepth))
           skill.pick_best(multiPV);
@@ -509,6 +946,11 @@ void Thread::search() {
           && VALUE_MATE - bestValue <= 2 * Limits.mate)
           Signals.stop = true;
 
+      // Share of the nodes of this iteration, summed over all the threads, that
+      // went to the best move. Updated at every iteration, not only when time
+      // management is used, to keep the snapshots of EffortTable fresh.
+      double bestMoveEffort = Effort.update(rootMoves);
+
       // Do we have time for the next iteration? Can we stop searching now?
       if (Limits.use_time_management())
       {
@@ -524,12 +966,17 @@ void Thread::search() {
                                    : 353 + std::max(-124, std::min(247,  6 * scoreDiff));
               double unstablePvFactor = 1 + mainThread->bestMoveChanges;
 
+              // Spend less time when the best move took most of the effort,
+              // more when other moves needed deep searches to be refuted. The
+              // shares are too noisy at low depths.
+              double effortFactor = rootDepth >= 8 * ONE_PLY ? 1.6 - 0.8 * bestMoveEffort : 1.0;
+
               bool doEasyMove =   rootMoves[0].pv[0] == easyMove
                                && mainThread->bestMoveChanges < 0.03
                                && Time.elapsed() > Time.optimum() * 5 / 42;
 
               if (   rootMoves.size() == 1
-                  || Time.elapsed() > Time.optimum() * unstablePvFactor * improvingFactor / 628
+                  || Time.elapsed() > Time.optimum() * unstablePvFactor * effortFactor * improvingFactor / 628
                   || (mainThread->easyMovePlayed = doEasyMove))
               {
                   // If we are allowed to ponder do not stop the search now but
@@ -548,6 +995,12 @@ void Thread::search() {
       }
   }
 
+  // Wait for the others to complete the last iteration, otherwise the main
+  // thread would stop them at some random point. Not after a stop, as then
+  // the others may have left already.
+  if (Deterministic && !leftSync)
+      Sync.wait(idx);
+
   if (!mainThread)
       return;
 
@@ -577,17 +1030,18 @@ namespace {
     assert(PvNode || (alpha == beta - 1));
     assert(DEPTH_ZERO < depth && depth < DEPTH_MAX);
 
-    Move pv[MAX_PLY+1], quietsSearched[64];
+    Move pv[MAX_PLY+1], quietsSearched[64], deferred[32];
     StateInfo st;
     TTEntry* tte;
-    Key posKey;
+    TTEntry ttData;
+    Key posKey, busyKey;
     Move ttMove, move, excludedMove, bestMove;
     Depth extension, newDepth, predictedDepth;
     Value bestValue, value, ttValue, eval, nullValue, futilityValue;
-    bool ttHit, inCheck, givesCheck, singularExtensionNode, improving;
-    bool captureOrPromotion, doFullDepthSearch, moveCountPruning;
+    bool ttHit, inCheck, givesCheck, singularExtensionNode, improving, useBusy;
+    bool captureOrPromotion, doFullDepthSearch, moveCountPruning, lazyEval = false;
     Piece moved_piece;
-    int moveCount, quietCount;
+    int moveCount, quietCount, deferredCount, deferredIdx;
 
     // Step 1. Initialize node
     Thread* thisThread = pos.this_thread();
@@ -595,20 +1049,7 @@ namespace {
     moveCount = quietCount =  ss->moveCount = 0;
     bestValue = -VALUE_INFINITE;
     ss->ply = (ss-1)->ply + 1;
-
-    // Check for the available remaining time
-    if (thisThread->resetCalls.load(std::memory_order_relaxed))
-    {
-        thisThread->resetCalls = false;
-        thisThread->callsCnt = 0;
-    }
-    if (++thisThread->callsCnt > 4096)
-    {
-        for (Thread* th : Threads)
-            th->resetCalls = true;
-
-        check_time();
-    }
+    PRUNE_NODE(depth);
 
     // Used to send selDepth info to GUI
     if (PvNode && thisThread->maxPly < ss->ply)
@@ -621,6 +1062,17 @@ namespace {
             return ss->ply >= MAX_PLY && !inCheck ? evaluate(pos)
                                                   : DrawValue[pos.side_to_move()];
 
+        // Step 2a. If a move draws by repetition, or an earlier position had a
+        // move to this one, the draw is at least within reach.
+        if (   alpha < DrawValue[pos.side_to_move()]
+            && pos.rule50_count() >= 3
+            && pos.has_game_cycle(ss->ply))
+        {
+            alpha = DrawValue[pos.side_to_move()];
+            if (alpha >= beta)
+                return alpha;
+        }
+
         // Step 3. Mate distance pruning. Even if we mate at the next move our score
         // would be at best mate_in(ss->ply+1), but if alpha is already bigger because
         // a shorter mate was found upward in the tree then there is no need to search
@@ -644,19 +1096,19 @@ namespace {
     // search to overwrite a previous full search TT value, so we use a different
     // position key in case of an excluded move.
     excludedMove = ss->excludedMove;
-    posKey = pos.key() ^ Key(excludedMove);
-    tte = TT.probe(posKey, ttHit);
-    ttValue = ttHit ? value_from_tt(tte->value(), ss->ply) : VALUE_NONE;
+    posKey = excludedMove ? pos.key() ^ make_key(excludedMove) : pos.key();
+    tte = probe_tt(pos, posKey, ttHit, ttData);
+    ttValue = ttHit ? value_from_tt(ttData.value(), ss->ply) : VALUE_NONE;
     ttMove =  rootNode ? thisThread->rootMoves[thisThread->PVIdx].pv[0]
-            : ttHit    ? tte->move() : MOVE_NONE;
+            : ttHit    ? ttData.move() : MOVE_NONE;
 
-    // At non-PV nodes we check for an early TT cutoff
+    // At non-PV nodes we check for an early TT cutoff. Entries saved without
+    // a value have BOUND_NONE, so a verified hit needs no further checks.
     if (  !PvNode
         && ttHit
-        && tte->depth() >= depth
-        && ttValue != VALUE_NONE // Possible in case of TT access race
-        && (ttValue >= beta ? (tte->bound() & BOUND_LOWER)
-                            : (tte->bound() & BOUND_UPPER)))
+        && ttData.depth() >= depth
+        && (ttValue >= beta ? (ttData.bound() & BOUND_LOWER)
+                            : (ttData.bound() & BOUND_UPPER)))
     {
         ss->currentMove = ttMove; // Can be MOVE_NONE
 
@@ -703,7 +1155,9 @@ namespace {
         }
     }
 
-    // Step 5. Evaluate the position statically
+    // Step 5. Evaluate the position statically. At non-PV nodes razoring and
+    // futility only need to know on which side of the window the eval lies, a
+    // lazy eval is replaced by the full one if the node goes past them.
     if (inCheck)
     {
         ss->staticEval = eval = VALUE_NONE;
@@ -713,22 +1167,25 @@ namespace {
     else if (ttHit)
     {
         // Never assume anything on values stored in TT
-        if ((ss->staticEval = eval = tte->eval()) == VALUE_NONE)
-            eval = ss->staticEval = evaluate(pos);
+        if ((ss->staticEval = eval = ttData.eval()) == VALUE_NONE)
+            eval = ss->staticEval = PvNode || ss->skipEarlyPruning ? evaluate(pos)
+                                  : lazy_evaluate(pos, alpha, beta, depth, lazyEval);
 
         // Can ttValue be used as a better position evaluation?
         if (ttValue != VALUE_NONE)
-            if (tte->bound() & (ttValue > eval ? BOUND_LOWER : BOUND_UPPER))
+            if (ttData.bound() & (ttValue > eval ? BOUND_LOWER : BOUND_UPPER))
                 eval = ttValue;
     }
     else
     {
         eval = ss->staticEval =
-        (ss-1)->currentMove != MOVE_NULL ? evaluate(pos)
-                                         : -(ss-1)->staticEval + 2 * Eval::Tempo;
+        (ss-1)->currentMove == MOVE_NULL ? -(ss-1)->staticEval + 2 * Eval::Tempo
+        : PvNode || ss->skipEarlyPruning ? evaluate(pos)
+                                         : lazy_evaluate(pos, alpha, beta, depth, lazyEval);
 
+        // A lazy eval is good only for this window, it is not saved
         tte->save(posKey, VALUE_NONE, BOUND_NONE, DEPTH_NONE, MOVE_NONE,
-                  ss->staticEval, TT.generation());
+                  lazyEval ? VALUE_NONE : ss->staticEval, TT.generation());
     }
 
     if (ss->skipEarlyPruning)
@@ -740,22 +1197,49 @@ namespace {
         &&  ttMove == MOVE_NONE
         &&  eval + razor_margin[depth / ONE_PLY] <= alpha)
     {
+        PRUNE_STAT(RAZORING, depth, ATTEMPT);
+
         if (depth <= ONE_PLY)
+        {
+            PRUNE_STAT(RAZORING, depth, CUTOFF);
             return qsearch<NonPV, false>(pos, ss, alpha, beta, DEPTH_ZERO);
+        }
 
         Value ralpha = alpha - razor_margin[depth];
         Value v = qsearch<NonPV, false>(pos, ss, ralpha, ralpha+1, DEPTH_ZERO);
         if (v <= ralpha)
+        {
+            PRUNE_STAT(RAZORING, depth, CUTOFF);
             return v;
+        }
     }
 
     // Step 7. Futility pruning: child node (skipped when in check)
     if (   !rootNode
         &&  depth < 7 * ONE_PLY
-		&&  eval - futility_margin(depth, cutNode) >= beta
         &&  eval < VALUE_KNOWN_WIN  // Do not return unproven wins
         &&  pos.non_pawn_material(pos.side_to_move()))
-		return eval - futility_margin(depth, cutNode);
+    {
+        PRUNE_STAT(FUTILITY, depth, ATTEMPT);
+
+        if (eval - futility_margin(depth, cutNode) >= beta)
+        {
+            PRUNE_STAT(FUTILITY, depth, CUTOFF);
+            return eval - futility_margin(depth, cutNode);
+        }
+    }
+
+    // The steps below, and the move loop through 'improving' and the futility
+    // margins, need the full eval.
+    if (lazyEval)
+    {
+        PRUNE_STAT(LAZY_EVAL, depth, RESEARCH);
+        eval = ss->staticEval = evaluate(pos);
+
+        if (ttValue != VALUE_NONE)
+            if (ttData.bound() & (ttValue > eval ? BOUND_LOWER : BOUND_UPPER))
+                eval = ttValue;
+    }
 
     // Step 8. Null move search with verification search (is omitted in PV nodes)
     if (   !PvNode
@@ -768,6 +1252,8 @@ namespace {
 
         assert(eval - beta >= 0);
 
+        PRUNE_STAT(NULL_MOVE, depth, ATTEMPT);
+
         // Null move dynamic reduction based on depth and value
         Depth R = ((823 + 67 * depth) / 256 + std::min((eval - beta) / PawnValueMg, 3)) * ONE_PLY;
 
@@ -785,16 +1271,25 @@ namespace {
                 nullValue = beta;
 
             if (depth < 12 * ONE_PLY && abs(beta) < VALUE_KNOWN_WIN)
+            {
+                PRUNE_STAT(NULL_MOVE, depth, CUTOFF);
                 return nullValue;
+            }
 
             // Do verification search at high depths
+            PRUNE_STAT(NULL_MOVE, depth, RESEARCH);
+            PRUNE_STAT(NULL_VERIFY, depth, ATTEMPT);
             ss->skipEarlyPruning = true;
             Value v = depth-R < ONE_PLY ? qsearch<NonPV, false>(pos, ss, beta-1, beta, DEPTH_ZERO)
                                         :  search<NonPV>(pos, ss, beta-1, beta, depth-R, false);
             ss->skipEarlyPruning = false;
 
             if (v >= beta)
+            {
+                PRUNE_STAT(NULL_MOVE, depth, CUTOFF);
+                PRUNE_STAT(NULL_VERIFY, depth, CUTOFF);
                 return nullValue;
+            }
         }
     }
 
@@ -816,6 +1311,8 @@ namespace {
         MovePicker mp(pos, ttMove, rbeta - ss->staticEval);
         CheckInfo ci(pos);
 
+        PRUNE_STAT(PROBCUT, depth, ATTEMPT);
+
         while ((move = mp.next_move()) != MOVE_NONE)
             if (pos.legal(move, ci.pinned))
             {
@@ -825,7 +1322,10 @@ namespace {
                 value = -search<NonPV>(pos, ss+1, -rbeta, -rbeta+1, rdepth, !cutNode);
                 pos.undo_move(move);
                 if (value >= rbeta)
+                {
+                    PRUNE_STAT(PROBCUT, depth, CUTOFF);
                     return value;
+                }
             }
     }
 
@@ -835,12 +1335,16 @@ namespace {
         && (PvNode || ss->staticEval + 256 >= beta))
     {
         Depth d = depth - 2 * ONE_PLY - (PvNode ? DEPTH_ZERO : depth / 4);
+        PRUNE_STAT(IID, depth, ATTEMPT);
         ss->skipEarlyPruning = true;
         search<NT>(pos, ss, alpha, beta, d, cutNode);
         ss->skipEarlyPruning = false;
 
-        tte = TT.probe(posKey, ttHit);
-        ttMove = ttHit ? tte->move() : MOVE_NONE;
+        tte = probe_tt(pos, posKey, ttHit, ttData);
+        ttMove = ttHit ? ttData.move() : MOVE_NONE;
+
+        if (ttMove)
+            PRUNE_STAT(IID, depth, CUTOFF);
     }
 
 moves_loop: // When in check search starts from here
@@ -861,12 +1365,18 @@ moves_loop: // When in check search starts from here
                            &&  ttMove != MOVE_NONE
                            &&  ttValue != VALUE_NONE
                            && !excludedMove // Recursive singular search is not allowed
-                           && (tte->bound() & BOUND_LOWER)
-                           &&  tte->depth() >= depth - 3 * ONE_PLY;
+                           && (ttData.bound() & BOUND_LOWER)
+                           &&  ttData.depth() >= depth - 3 * ONE_PLY;
+
+    useBusy = !rootNode && depth >= BusyTable::MinDepth * ONE_PLY && Threads.size() > 1 && !Deterministic;
+    deferredCount = deferredIdx = 0;
 
     // Step 11. Loop through moves
-    // Loop through all pseudo-legal moves until no moves remain or a beta cutoff occurs
-    while ((move = mp.next_move()) != MOVE_NONE)
+    // Loop through all pseudo-legal moves until no moves remain or a beta cutoff
+    // occurs, then through the moves deferred because another thread was busy
+    // with them.
+    while (   (move = mp.next_move()) != MOVE_NONE
+           || (deferredIdx < deferredCount && (move = deferred[deferredIdx++]) != MOVE_NONE))
     {
       assert(is_ok(move));
 
@@ -880,6 +1390,20 @@ moves_loop: // When in check search starts from here
                                   thisThread->rootMoves.end(), move))
           continue;
 
+      // The first move is always searched, the others are deferred once if
+      // another thread is searching them at this very node.
+      busyKey = posKey ^ make_key(move);
+
+      if (   useBusy
+          && moveCount
+          && !deferredIdx
+          && deferredCount < 32
+          && Busy.busy(busyKey))
+      {
+          deferred[deferredCount++] = move;
+          continue;
+      }
+
       ss->moveCount = ++moveCount;
 
       if (rootNode && thisThread == Threads.main() && Time.elapsed() > 3000)
@@ -918,6 +1442,7 @@ moves_loop: // When in check search starts from here
           &&  pos.legal(move, ci.pinned))
       {
           Value rBeta = std::max(ttValue - 2 * depth / ONE_PLY, -VALUE_MATE);
+          PRUNE_STAT(SINGULAR, depth, ATTEMPT);
           ss->excludedMove = move;
           ss->skipEarlyPruning = true;
           value = search<NonPV>(pos, ss, rBeta - 1, rBeta, depth / 2, cutNode);
@@ -925,7 +1450,10 @@ moves_loop: // When in check search starts from here
           ss->excludedMove = MOVE_NONE;
 
           if (value < rBeta)
+          {
+              PRUNE_STAT(SINGULAR, depth, CUTOFF);
               extension = ONE_PLY;
+          }
       }
 
       // Update the current move (this must be done after singular extension search)
@@ -939,16 +1467,27 @@ moves_loop: // When in check search starts from here
           && !pos.advanced_pawn_push(move))
       {
           // Move count based pruning
+          PRUNE_STAT(MOVE_COUNT, depth, ATTEMPT);
+
           if (moveCountPruning)
+          {
+              PRUNE_STAT(MOVE_COUNT, depth, CUTOFF);
               continue;
+          }
 
           // History based pruning
+          if (depth <= 4 * ONE_PLY)
+              PRUNE_STAT(HISTORY, depth, ATTEMPT);
+
           if (   depth <= 4 * ONE_PLY
               && move != ss->killers[0]
               && (!cmh || (*cmh)[moved_piece][to_sq(move)] < VALUE_ZERO)
               && (!fmh || (*fmh)[moved_piece][to_sq(move)] < VALUE_ZERO)
               && (!fmh2 || (cmh && fmh) || (*fmh2)[moved_piece][to_sq(move)] < VALUE_ZERO))
+          {
+              PRUNE_STAT(HISTORY, depth, CUTOFF);
               continue;
+          }
 
           predictedDepth = std::max(newDepth - reduction<PvNode>(improving, depth, moveCount), DEPTH_ZERO);
 
@@ -956,36 +1495,48 @@ moves_loop: // When in check search starts from here
           if (predictedDepth < 7 * ONE_PLY)
           {
               futilityValue = ss->staticEval + futility_margin(predictedDepth) + 256;
+              PRUNE_STAT(FUTILITY_PARENT, depth, ATTEMPT);
 
               if (futilityValue <= alpha)
               {
+                  PRUNE_STAT(FUTILITY_PARENT, depth, CUTOFF);
                   bestValue = std::max(bestValue, futilityValue);
                   continue;
               }
           }
 
           // Prune moves with negative SEE at low depths
-          if (predictedDepth < 4 * ONE_PLY && pos.see_sign(move) < VALUE_ZERO)
+          if (predictedDepth < 4 * ONE_PLY)
+          {
+              PRUNE_STAT(SEE, depth, ATTEMPT);
+
+              if (pos.see_sign(move) < VALUE_ZERO)
+              {
+                  PRUNE_STAT(SEE, depth, CUTOFF);
+                  continue;
+              }
+          }
+      }
+
+      // Prune captures, checks and advanced pawn pushes with negative SEE
+      // at very low depths
+      else if (   depth < 3 * ONE_PLY
+               && !inCheck
+               &&  bestValue > VALUE_MATED_IN_MAX_PLY
+               && !rootNode
+               && (captureOrPromotion || givesCheck || pos.advanced_pawn_push(move)))
+      {
+          PRUNE_STAT(SEE_TACTICAL, depth, ATTEMPT);
+
+          if (pos.see_sign(move) < VALUE_ZERO)
+          {
+              PRUNE_STAT(SEE_TACTICAL, depth, CUTOFF);
               continue;
+          }
       }
 
-      else if(
-	      
-	          depth < 3 * ONE_PLY
-              && !inCheck
-	      &&  bestValue > VALUE_MATED_IN_MAX_PLY
-	      && !rootNode
-	      && (  captureOrPromotion
-		  || givesCheck
-		  || pos.advanced_pawn_push(move)
-		  )
-	      && pos.see_sign(move) < VALUE_ZERO
-	  )
-	{
-	    continue;
-	}
       // Speculative prefetch as early as possible
-      prefetch(TT.first_entry(pos.key_after(move)));
+      prefetch_after(pos, move);
 
       // Check for legality just before making the move
       if (!rootNode && !pos.legal(move, ci.pinned))
@@ -997,7 +1548,11 @@ moves_loop: // When in check search starts from here
       ss->currentMove = move;
       ss->counterMoves = &thisThread->counterMoveHistory[moved_piece][to_sq(move)];
 
+      if (useBusy)
+          Busy.mark(busyKey);
+
       // Step 14. Make the move
+      uint64_t nodes = rootNode ? pos.nodes_searched() : 0;
       pos.do_move(move, st, givesCheck);
 
       // Step 15. Reduced depth search (LMR). If the move fails high it will be
@@ -1044,6 +1599,16 @@ moves_loop: // When in check search starts from here
           value = -search<NonPV>(pos, ss+1, -(alpha+1), -alpha, d, true);
 
           doFullDepthSearch = (value > alpha && r != DEPTH_ZERO);
+
+          if (r)
+          {
+              PRUNE_STAT(LMR, depth, ATTEMPT);
+
+              if (doFullDepthSearch)
+                  PRUNE_STAT(LMR, depth, RESEARCH);
+              else
+                  PRUNE_STAT(LMR, depth, CUTOFF);
+          }
       }
       else
           doFullDepthSearch = !PvNode || moveCount > 1;
@@ -1072,6 +1637,12 @@ moves_loop: // When in check search starts from here
       // Step 17. Undo move
       pos.undo_move(move);
 
+      if (rootNode)
+          Effort.add(move, pos.nodes_searched() - nodes);
+
+      if (useBusy)
+          Busy.unmark(busyKey);
+
       assert(value > -VALUE_INFINITE && value < VALUE_INFINITE);
 
       // Step 18. Check for a new best move
@@ -1211,10 +1782,11 @@ moves_loop: // When in check search starts from here
     Move pv[MAX_PLY+1];
     StateInfo st;
     TTEntry* tte;
+    TTEntry ttData;
     Key posKey;
     Move ttMove, move, bestMove;
     Value bestValue, value, ttValue, futilityValue, futilityBase, oldAlpha;
-    bool ttHit, givesCheck, evasionPrunable;
+    bool ttHit, givesCheck, evasionPrunable, lazyEval = false;
     Depth ttDepth;
 
     if (PvNode)
@@ -1226,6 +1798,7 @@ moves_loop: // When in check search starts from here
 
     ss->currentMove = bestMove = MOVE_NONE;
     ss->ply = (ss-1)->ply + 1;
+    PRUNE_NODE(DEPTH_ZERO);
 
     // Check for an instant draw or if the maximum ply has been reached
     if (pos.is_draw() || ss->ply >= MAX_PLY)
@@ -1242,16 +1815,16 @@ moves_loop: // When in check search starts from here
 
     // Transposition table lookup
     posKey = pos.key();
-    tte = TT.probe(posKey, ttHit);
-    ttMove = ttHit ? tte->move() : MOVE_NONE;
-    ttValue = ttHit ? value_from_tt(tte->value(), ss->ply) : VALUE_NONE;
+    tte = QSTier ? TT.probe(pos.this_thread()->qsTable, posKey, ttHit, ttData)
+                 : probe_tt(pos, posKey, ttHit, ttData);
+    ttMove = ttHit ? ttData.move() : MOVE_NONE;
+    ttValue = ttHit ? value_from_tt(ttData.value(), ss->ply) : VALUE_NONE;
 
     if (  !PvNode
         && ttHit
-        && tte->depth() >= ttDepth
-        && ttValue != VALUE_NONE // Only in case of TT access race
-        && (ttValue >= beta ? (tte->bound() &  BOUND_LOWER)
-                            : (tte->bound() &  BOUND_UPPER)))
+        && ttData.depth() >= ttDepth
+        && (ttValue >= beta ? (ttData.bound() &  BOUND_LOWER)
+                            : (ttData.bound() &  BOUND_UPPER)))
     {
         ss->currentMove = ttMove; // Can be MOVE_NONE
         return ttValue;
@@ -1268,25 +1841,27 @@ moves_loop: // When in check search starts from here
         if (ttHit)
         {
             // Never assume anything on values stored in TT
-            if ((ss->staticEval = bestValue = tte->eval()) == VALUE_NONE)
-                ss->staticEval = bestValue = evaluate(pos);
+            if ((ss->staticEval = bestValue = ttData.eval()) == VALUE_NONE)
+                ss->staticEval = bestValue = PvNode ? evaluate(pos)
+                                           : lazy_evaluate(pos, alpha, beta, DEPTH_ZERO, lazyEval);
 
             // Can ttValue be used as a better position evaluation?
             if (ttValue != VALUE_NONE)
-                if (tte->bound() & (ttValue > bestValue ? BOUND_LOWER : BOUND_UPPER))
+                if (ttData.bound() & (ttValue > bestValue ? BOUND_LOWER : BOUND_UPPER))
                     bestValue = ttValue;
         }
         else
             ss->staticEval = bestValue =
-            (ss-1)->currentMove != MOVE_NULL ? evaluate(pos)
-                                             : -(ss-1)->staticEval + 2 * Eval::Tempo;
+            (ss-1)->currentMove == MOVE_NULL ? -(ss-1)->staticEval + 2 * Eval::Tempo
+                                   : PvNode ? evaluate(pos)
+                                            : lazy_evaluate(pos, alpha, beta, DEPTH_ZERO, lazyEval);
 
         // Stand pat. Return immediately if static value is at least beta
         if (bestValue >= beta)
         {
             if (!ttHit)
                 tte->save(pos.key(), value_to_tt(bestValue, ss->ply), BOUND_LOWER,
-                          DEPTH_NONE, MOVE_NONE, ss->staticEval, TT.generation());
+                          DEPTH_NONE, MOVE_NONE, lazyEval ? VALUE_NONE : ss->staticEval, TT.generation());
 
             return bestValue;
         }
@@ -1348,7 +1923,7 @@ moves_loop: // When in check search starts from here
           continue;
 
       // Speculative prefetch as early as possible
-      prefetch(TT.first_entry(pos.key_after(move)));
+      prefetch_after(pos, move, QSTier);
 
       // Check for legality just before making the move
       if (!pos.legal(move, ci.pinned))
@@ -1382,7 +1957,7 @@ moves_loop: // When in check search starts from here
               else // Fail high
               {
                   tte->save(posKey, value_to_tt(value, ss->ply), BOUND_LOWER,
-                            ttDepth, move, ss->staticEval, TT.generation());
+                            ttDepth, move, lazyEval ? VALUE_NONE : ss->staticEval, TT.generation());
 
                   return value;
               }
@@ -1397,7 +1972,7 @@ moves_loop: // When in check search starts from here
 
     tte->save(posKey, value_to_tt(bestValue, ss->ply),
               PvNode && bestValue > oldAlpha ? BOUND_EXACT : BOUND_UPPER,
-              ttDepth, bestMove, ss->staticEval, TT.generation());
+              ttDepth, bestMove, lazyEval ? VALUE_NONE : ss->staticEval, TT.generation());
 
     assert(bestValue > -VALUE_INFINITE && bestValue < VALUE_INFINITE);
 
@@ -1405,31 +1980,6 @@ moves_loop: // When in check search starts from here
   }
 
 
-  // value_to_tt() adjusts a mate score from "plies to mate from the root" to
-  // "plies to mate from the current position". Non-mate scores are unchanged.
-  // The function is called before storing a value in the transposition table.
-
-  Value value_to_tt(Value v, int ply) {
-
-    assert(v != VALUE_NONE);
-
-    return  v >= VALUE_MATE_IN_MAX_PLY  ? v + ply
-          : v <= VALUE_MATED_IN_MAX_PLY ? v - ply : v;
-  }
-
-
-  // value_from_tt() is the inverse of value_to_tt(): It adjusts a mate score
-  // from the transposition table (which refers to the plies to mate/be mated
-  // from current position) to "plies to mate/be mated from the root".
-
-  Value value_from_tt(Value v, int ply) {
-
-    return  v == VALUE_NONE             ? VALUE_NONE
-          : v >= VALUE_MATE_IN_MAX_PLY  ? v - ply
-          : v <= VALUE_MATED_IN_MAX_PLY ? v + ply : v;
-  }
-
-
   // update_pv() adds current move and appends child pv[]
 
   void update_pv(Move* pv, Move move, Move* childPv) {
@@ -1539,8 +2089,9 @@ moves_loop: // When in check search starts from here
   }
 
 
-  // check_time() is used to print debug info and, more importantly, to detect
-  // when we are out of available time and thus stop the search.
+  // check_time() is called by the timer thread to print debug info and, more
+  // importantly, to detect when we are out of available time or nodes and thus
+  // stop the search.
 
   void check_time() {
 
@@ -1561,7 +2112,7 @@ moves_loop: // When in check search starts from here
 
     if (   (Limits.use_time_management() && elapsed > Time.maximum() - 10)
         || (Limits.movetime && elapsed >= Limits.movetime)
-        || (Limits.nodes && Threads.nodes_searched() >= Limits.nodes))
+        || (Limits.nodes && !Deterministic && Threads.nodes_searched() >= Limits.nodes))
             Signals.stop = true;
   }
 
@@ -1571,15 +2122,17 @@ moves_loop: // When in check search starts from here
 /// UCI::pv() formats PV information according to the UCI protocol. UCI requires
 /// that all (if any) unsearched PV lines are sent using a previous search score.
 
-string UCI::pv(const Position& pos, Depth depth, Value alpha, Value beta) {
+const string& UCI::pv(const Position& pos, Depth depth, Value alpha, Value beta) {
 
-  std::stringstream ss;
+  string& s = PVBuffer;
   int elapsed = Time.elapsed() + 1;
   const RootMoves& rootMoves = pos.this_thread()->rootMoves;
   size_t PVIdx = pos.this_thread()->PVIdx;
   size_t multiPV = std::min((size_t)Options["MultiPV"], rootMoves.size());
   uint64_t nodes_searched = Threads.nodes_searched();
 
+  s.clear(); // Keeps the capacity
+
   for (size_t i = 0; i < multiPV; ++i)
   {
       bool updated = (i <= PVIdx);
@@ -1587,39 +2140,42 @@ string UCI::pv(const Position& pos, Depth depth, Value alpha, Value beta) {
       if (depth == ONE_PLY && !updated)
           continue;
 
-      Depth d = updated ? depth : depth - ONE_PLY;
+      if (Split.groups ? !rootMoves[i].depth
+                       : (updated ? rootMoves[i].score : rootMoves[i].previousScore) == -VALUE_INFINITE)
+          continue; // A line not searched yet
+
+      Depth d = Split.groups ? rootMoves[i].depth : updated ? depth : depth - ONE_PLY;
       Value v = updated ? rootMoves[i].score : rootMoves[i].previousScore;
 
       bool tb = TB::RootInTB && abs(v) < VALUE_MATE - MAX_PLY;
       v = tb ? TB::Score : v;
 
-      if (ss.rdbuf()->in_avail()) // Not at first line
-          ss << "\n";
+      if (!s.empty()) // Not at first line
+          s += '\n';
 
-      ss << "info"
-         << " depth "    << d / ONE_PLY
-         << " seldepth " << pos.this_thread()->maxPly
-         << " multipv "  << i + 1
-         << " score "    << UCI::value(v);
+      s += "info depth ";  append(s, d / ONE_PLY);
+      s += " seldepth ";   append(s, pos.this_thread()->maxPly);
+      s += " multipv ";    append(s, i + 1);
+      s += " score ";      s += UCI::value(v);
 
       if (!tb && i == PVIdx)
-          ss << (v >= beta ? " lowerbound" : v <= alpha ? " upperbound" : "");
+          s += v >= beta ? " lowerbound" : v <= alpha ? " upperbound" : "";
 
-      ss << " nodes "    << nodes_searched
-         << " nps "      << nodes_searched * 1000 / elapsed;
+      s += " nodes ";      append(s, nodes_searched);
+      s += " nps ";        append(s, nodes_searched * 1000 / elapsed);
 
       if (elapsed > 1000) // Earlier makes little sense
-          ss << " hashfull " << TT.hashfull();
+          s += " hashfull ", append(s, TT.hashfull());
 
-      ss << " tbhits "   << TB::Hits
-         << " time "     << elapsed
-         << " pv";
+      s += " tbhits ";     append(s, TB::Hits);
+      s += " time ";       append(s, elapsed);
+      s += " pv";
 
       for (Move m : rootMoves[i].pv)
-          ss << " " << UCI::move(m, pos.is_chess960());
+          s += ' ', s += UCI::move(m, pos.is_chess960()); // Short enough to stay inline
   }
 
-  return ss.str();
+  return s;
 }
 
 
@@ -1631,6 +2187,7 @@ string UCI::pv(const Position& pos, Depth depth, Value alpha, Value beta) {
 bool RootMove::extract_ponder_from_tt(Position& pos)
 {
     StateInfo st;
+    TTEntry ttData;
     bool ttHit;
 
     assert(pv.size() == 1);
@@ -1639,11 +2196,11 @@ bool RootMove::extract_ponder_from_tt(Position& pos)
         return false;
 
     pos.do_move(pv[0], st, pos.gives_check(pv[0], CheckInfo(pos)));
-    TTEntry* tte = TT.probe(pos.key(), ttHit);
+    TT.probe(pos.key(), ttHit, ttData);
 
     if (ttHit)
     {
-        Move m = tte->move(); // Local copy to be SMP safe
+        Move m = ttData.move(); // Verified copy, SMP safe
         if (MoveList<LEGAL>(pos).contains(m))
             pv.push_back(m);
     }
@@ -1695,4 +2252,85 @@ void Tablebases::filter_root_moves(Position& pos, Search::RootMoves& rootMoves)
                        : TB::Score < VALUE_DRAW ? -VALUE_MATE + MAX_PLY + 1
                                                 :  VALUE_DRAW;
     }
-}
\ No newline at end of file
+}
+
+
+/// PruneStats::operator+=() sums up the counters of several threads or searches
+
+PruneStats& PruneStats::operator+=(const PruneStats& s) {
+
+  for (int st = 0; st < STEP_NB; ++st)
+      for (int d = 0; d < DepthNb; ++d)
+          for (int o = 0; o < OUTCOME_NB; ++o)
+              count[st][d][o] += s.count[st][d][o];
+
+  for (int d = 0; d < DepthNb; ++d)
+      nodes[d] += s.nodes[d], iterations[d] += s.iterations[d];
+
+  return *this;
+}
+
+
+/// operator<<(PruneStats) prints the totals of each step, then by depth the
+/// nodes at that remaining depth, the nodes of the iteration to that depth,
+/// the effective branching factor (nodes of the iteration per node of the
+/// previous one) and the success rate of each step, in percent.
+
+std::ostream& Search::operator<<(std::ostream& os, const PruneStats& s) {
+
+  const char* Names[] = { "razoring", "futility", "null move", "null verify",
+                          "probcut", "iid", "singular", "move count", "history",
+                          "futility move", "see", "see tactical", "lmr", "lazy eval" };
+  const char* Short[] = { "raz", "fut", "null", "nver", "pcut", "iid", "sing",
+                          "mcp", "hist", "fmov", "see", "seet", "lmr", "lazy" };
+
+  auto pct = [](uint64_t n, uint64_t total) {
+    return total ? 100.0 * n / total : 0.0;
+  };
+
+  std::ios::fmtflags flags = os.flags();
+  os << std::fixed << std::setprecision(1)
+     << "Step           Attempts    Success       %   Re-search       %";
+
+  for (int st = 0; st < PruneStats::STEP_NB; ++st)
+  {
+      uint64_t total[PruneStats::OUTCOME_NB] = {};
+
+      for (int d = 0; d < PruneStats::DepthNb; ++d)
+          for (int o = 0; o < PruneStats::OUTCOME_NB; ++o)
+              total[o] += s.count[st][d][o];
+
+      os << "\n" << std::left << std::setw(13) << Names[st] << std::right
+         << std::setw(11) << total[PruneStats::ATTEMPT]
+         << std::setw(11) << total[PruneStats::CUTOFF]
+         << std::setw(8)  << pct(total[PruneStats::CUTOFF], total[PruneStats::ATTEMPT])
+         << std::setw(12) << total[PruneStats::RESEARCH]
+         << std::setw(8)  << pct(total[PruneStats::RESEARCH], total[PruneStats::ATTEMPT]);
+  }
+
+  os << "\n\nDepth        Nodes    Iteration   EBF";
+
+  for (const char* name : Short)
+      os << std::setw(5) << name;
+
+  for (int d = 0; d < PruneStats::DepthNb && (s.nodes[d] || s.iterations[d]); ++d)
+  {
+      os << "\n" << std::setw(5) << d << std::setw(13) << s.nodes[d]
+         << std::setw(13) << s.iterations[d]
+         << std::setw(6) << (d > 1 && s.iterations[d - 1] ? double(s.iterations[d]) / s.iterations[d - 1] : 0.0);
+
+      for (int st = 0; st < PruneStats::STEP_NB; ++st)
+      {
+          const uint64_t* c = s.count[st][d];
+          uint64_t n = st == PruneStats::LMR ? c[PruneStats::RESEARCH] : c[PruneStats::CUTOFF];
+
+          if (c[PruneStats::ATTEMPT])
+              os << std::setw(5) << int(pct(n, c[PruneStats::ATTEMPT]) + 0.5);
+          else
+              os << "    -";
+      }
+  }
+
+  os.flags(flags);
+  return os << "\n(lmr column is the re-search rate, the others the success rate)";
+}
@@ -10,7 +10,11 @@
 #ifndef SEARCHING_H_INCLUDED
 #define SEARCHING_H_INCLUDED
 
+#include <algorithm>
 #include <atomic>
+#include <cassert>
+#include <cstring>
+#include <ostream>
 #include <vector>
 
 #include "mixed.h"
@@ -38,13 +42,36 @@ struct Stack {
   CounterMoveStats* counterMoves;
 };
 
+/// PVLine struct stores a principal variation inline, with room for the longest
+/// one the search can produce, so that updating and copying it never touches
+/// the heap. It offers the few std::vector methods the search uses.
+
+struct PVLine {
+
+  PVLine() : count(0) {}
+  explicit PVLine(Move m) : count(1) { moves[0] = m; }
+
+  size_t size() const { return count; }
+  void resize(size_t n) { assert(n <= count); count = n; } // Only shrinks
+  void push_back(Move m) { assert(count < MAX_PLY + 1); moves[count++] = m; }
+
+  Move& operator[](size_t i) { return moves[i]; }
+  Move operator[](size_t i) const { return moves[i]; }
+  const Move* begin() const { return moves; }
+  const Move* end() const { return moves + count; }
+
+private:
+  size_t count;
+  Move moves[MAX_PLY + 1];
+};
+
 /// RootMove struct is used for moves at the root of the tree. For each root move
 /// we store a score and a PV (really a refutation in the case of moves which
 /// fail low). Score is normally set at -VALUE_INFINITE for all non-pv moves.
 
 struct RootMove {
 
-  explicit RootMove(Move m) : pv(1, m) {}
+  explicit RootMove(Move m) : pv(m) {}
 
   bool operator<(const RootMove& m) const { return m.score < score; } // Descending sort
   bool operator==(const Move& m) const { return pv[0] == m; }
@@ -52,7 +79,9 @@ struct RootMove {
 
   Value score = -VALUE_INFINITE;
   Value previousScore = -VALUE_INFINITE;
-  std::vector<Move> pv;
+  uint64_t effort = 0; // Nodes searched under the move by all the threads
+  Depth depth = DEPTH_ZERO; // Iteration of the score, for the split MultiPV lines
+  PVLine pv;
 };
 
 typedef std::vector<RootMove> RootMoves;
@@ -85,11 +114,76 @@ struct SignalsType {
   std::atomic_bool stop, stopOnPonderhit;
 };
 
+/// PruneStats struct counts, by remaining depth, how often each pruning and
+/// reduction step of the search is tried, how often it succeeds (the node or
+/// the move is cut, the IID finds a move, the singular search extends) and how
+/// often its result has to be searched again. It also counts the nodes by
+/// remaining depth, and the nodes of each completed iteration for the effective
+/// branching factor. Like TTStats, each thread updates its own thread_local
+/// copy. The counting code is compiled in only with 'make searchstats=yes'
+/// (SEARCH_STATS), otherwise it costs nothing.
+
+struct PruneStats {
+
+  enum Step {
+    RAZORING, FUTILITY, NULL_MOVE, NULL_VERIFY, PROBCUT, IID, SINGULAR,
+    MOVE_COUNT, HISTORY, FUTILITY_PARENT, SEE, SEE_TACTICAL, LMR, LAZY_EVAL, STEP_NB
+  };
+  enum Outcome { ATTEMPT, CUTOFF, RESEARCH, OUTCOME_NB };
+
+  static const int DepthNb = 32; // Deeper steps are counted at DepthNb - 1
+
+  void clear() { std::memset(this, 0, sizeof(PruneStats)); }
+  PruneStats& operator+=(const PruneStats& s);
+
+  static int index(Depth d) { return std::max(0, std::min(int(d / ONE_PLY), DepthNb - 1)); }
+  void hit(Step s, Depth d, Outcome o) { ++count[s][index(d)][o]; }
+  void node(Depth d) { ++nodes[index(d)]; }
+
+  // Takes the nodes searched by the thread so far, at the end of an iteration
+  void iteration(Depth d, uint64_t searched) {
+    iterations[index(d)] += searched - counted;
+    counted = searched;
+  }
+
+  uint64_t count[STEP_NB][DepthNb][OUTCOME_NB];
+  uint64_t nodes[DepthNb]; // Quiescence nodes at depth 0
+  uint64_t iterations[DepthNb]; // Nodes of the iterations to each depth
+  uint64_t counted; // Nodes already given to an iteration
+
+  static thread_local PruneStats local;
+};
+
+std::ostream& operator<<(std::ostream& os, const PruneStats& s);
+
 extern SignalsType Signals;
 extern LimitsType Limits;
 
+/// value_to_tt() adjusts a mate score from "plies to mate from the root" to
+/// "plies to mate from the current position". Non-mate scores are unchanged.
+/// The function is called before storing a value in the transposition table.
+
+inline Value value_to_tt(Value v, int ply) {
+
+  assert(v != VALUE_NONE);
+
+  return  v >= VALUE_MATE_IN_MAX_PLY  ? v + ply
+        : v <= VALUE_MATED_IN_MAX_PLY ? v - ply : v;
+}
+
+/// value_from_tt() is the inverse of value_to_tt(): It adjusts a mate score
+/// from the transposition table (which refers to the plies to mate/be mated
+/// from current position) to "plies to mate/be mated from the root".
+
+inline Value value_from_tt(Value v, int ply) {
+
+  return  v == VALUE_NONE             ? VALUE_NONE
+        : v >= VALUE_MATE_IN_MAX_PLY  ? v - ply
+        : v <= VALUE_MATED_IN_MAX_PLY ? v + ply : v;
+}
+
 void init();
-void clear();
+void clear(bool lazyHash = false);
 template<bool Root = true> uint64_t perft(Position& pos, Depth depth);
 
 } // namespace Searching
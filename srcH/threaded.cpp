@@ -7,7 +7,7 @@
   There is no warranty of any kind.
 */
 
-#include <algorithm> // For std::count
+#include <algorithm> // For std::count, std::find and std::stable_sort
 #include <cassert>
 
 #include "movegenerator.h"
@@ -23,10 +23,14 @@ ThreadPool Threads; // Global object
 
 Thread::Thread() {
 
-  resetCalls = exit = false;
-  maxPly = callsCnt = 0;
+  exit = false;
+  epoch = 0;
+  maxPly = 0;
+  goLatency = wakeLatency = 0;
   history.clear();
   counterMoves.clear();
+  ttStats.clear();
+  pruneStats.clear();
   idx = Threads.size(); // Start from 0
 
   std::unique_lock<Mutex> lk(mutex);
@@ -42,6 +46,7 @@ Thread::~Thread() {
 
   mutex.lock();
   exit = true;
+  ++epoch;
   sleepCondition.notify_one();
   mutex.unlock();
   nativeThread.join();
@@ -58,10 +63,46 @@ void Thread::wait_for_search_finished() {
 }
 
 
+/// Thread::is_searching() tells, without waiting, whether the thread is busy
+/// with a search, including a finished one waiting for 'stop' or 'ponderhit'.
+
+bool Thread::is_searching() {
+
+  std::unique_lock<Mutex> lk(mutex);
+  return searching;
+}
+
+
+/// Thread::spin() polls 'done' for at most the 'Idle Spin' time, so that a
+/// thread woken soon after it went idle does not pay for the sleep on its
+/// condition variable. Returns whether 'done' became true while spinning.
+
+template<typename Predicate>
+bool Thread::spin(Predicate done) {
+
+  using namespace std::chrono;
+
+  steady_clock::time_point end = steady_clock::now() + microseconds(Threads.spinTime);
+
+  while (!done())
+  {
+      if (steady_clock::now() >= end)
+          return false;
+
+      std::this_thread::yield(); // Leave the core to a thread with real work
+  }
+
+  return true;
+}
+
+
 /// Thread::wait() waits on sleep condition until condition is true
 
 void Thread::wait(std::atomic_bool& condition) {
 
+  if (spin([&]{ return bool(condition); }))
+      return;
+
   std::unique_lock<Mutex> lk(mutex);
   sleepCondition.wait(lk, [&]{ return bool(condition); });
 }
@@ -76,10 +117,30 @@ void Thread::start_searching(bool resume) {
   if (!resume)
       searching = true;
 
+  wakeTime = std::chrono::steady_clock::now();
+  ++epoch;
   sleepCondition.notify_one();
 }
 
 
+/// Thread::execute() wakes up the thread to run the given task instead of a
+/// search. The thread is busy, as when searching, until the task is done. The
+/// wait and the assignment are done under one lock, so that a concurrent call
+/// can not overwrite the task before it has run.
+
+void Thread::execute(std::function<void()> f) {
+
+  std::unique_lock<Mutex> lk(mutex);
+  sleepCondition.wait(lk, [&]{ return !searching && !task; });
+
+  task = std::move(f);
+  searching = true;
+  lk.unlock();
+
+  start_searching(true);
+}
+
+
 /// Thread::idle_loop() is where the thread is parked when it has no work to do
 
 void Thread::idle_loop() {
@@ -89,6 +150,13 @@ void Thread::idle_loop() {
       std::unique_lock<Mutex> lk(mutex);
 
       searching = false;
+      uint64_t idleEpoch = epoch;
+
+      // Spin a while before going to sleep, a new search often follows soon
+      sleepCondition.notify_one(); // Wake up any waiting thread
+      lk.unlock();
+      spin([&]{ return epoch.load(std::memory_order_acquire) != idleEpoch; });
+      lk.lock();
 
       while (!searching && !exit)
       {
@@ -96,10 +164,34 @@ void Thread::idle_loop() {
           sleepCondition.wait(lk);
       }
 
+      int64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - wakeTime).count();
+      std::function<void()> job = std::move(task);
+      task = nullptr;
       lk.unlock();
 
-      if (!exit)
+      if (!exit && job)
+          job();
+
+      else if (!exit)
+      {
+          wakeLatency = latency;
+
+          // The root is set up here rather than in start_thinking(), so that
+          // all the threads do it at the same time.
+          rootPos.set(Threads.setupPos, &rootState, this);
+          rootMoves = Threads.setupRootMoves;
+
+          TTStats::local.clear();
+#ifdef SEARCH_STATS
+          Search::PruneStats::local.clear();
+#endif
           search();
+          ttStats = TTStats::local; // Published to other threads when searching is reset
+#ifdef SEARCH_STATS
+          pruneStats = Search::PruneStats::local;
+#endif
+      }
   }
 }
 
@@ -129,11 +221,13 @@ void ThreadPool::exit() {
 
 /// ThreadPool::read_uci_options() updates internal threads parameters from the
 /// corresponding UCI options and creates/destroys threads to match requested
-/// number. Thread objects are dynamically allocated.
+/// number. Thread objects are dynamically allocated. The QSTable of each thread
+/// is allocated only while 'QSearch Hash' is on.
 
 void ThreadPool::read_uci_options() {
 
   size_t requested = Options["Threads"];
+  spinTime = Options["Idle Spin"];
 
   assert(requested > 0);
 
@@ -142,6 +236,29 @@ void ThreadPool::read_uci_options() {
 
   while (size() > requested)
       delete back(), pop_back();
+
+  for (Thread* th : *this)
+      th->qsTable.resize(Options["QSearch Hash"] ? QSTable::DefaultBits : 0);
+}
+
+
+/// ThreadPool::execute() runs f(idx) for every thread index of the pool, each
+/// call on the thread of that index, and returns when all of them are done.
+/// The call of 'self', the pool thread calling execute() if any, is run in
+/// place. Used for work that should be done where the search threads run.
+
+void ThreadPool::execute(const std::function<void(size_t idx)>& f, Thread* self) {
+
+  for (Thread* th : *this)
+      if (th != self)
+          th->execute([=, &f]() { f(th->idx); });
+
+  if (self)
+      f(self->idx);
+
+  for (Thread* th : *this)
+      if (th != self)
+          th->wait_for_search_finished();
 }
 
 
@@ -156,6 +273,139 @@ int64_t ThreadPool::nodes_searched() {
 }
 
 
+/// ThreadPool::tt_stats() returns the transposition table counters of the last
+/// search summed over all the threads.
+
+TTStats ThreadPool::tt_stats() {
+
+  TTStats stats;
+  stats.clear();
+  for (Thread* th : *this)
+      stats += th->ttStats;
+  return stats;
+}
+
+
+/// ThreadPool::prune_stats() returns the pruning step counters of the last
+/// search summed over all the threads. They are all zero unless the program
+/// has been built with 'make searchstats=yes'.
+
+Search::PruneStats ThreadPool::prune_stats() {
+
+  Search::PruneStats stats;
+  stats.clear();
+  for (Thread* th : *this)
+      stats += th->pruneStats;
+  return stats;
+}
+
+
+/// ThreadPool::go_latency() returns the time in microseconds from the 'go' of
+/// the last search to its first node, searched by the main thread or, with
+/// 'allThreads', to the first node of the last thread to start searching.
+
+int64_t ThreadPool::go_latency(bool allThreads) {
+
+  int64_t latency = main()->goLatency;
+
+  if (allThreads)
+      for (Thread* th : *this)
+          latency = std::max(latency, th->goLatency);
+
+  return latency;
+}
+
+
+/// ThreadPool::wake_latency() returns the time in microseconds the main thread
+/// or, with 'allThreads', the slowest thread took to wake up for the last search.
+
+int64_t ThreadPool::wake_latency(bool allThreads) {
+
+  int64_t latency = main()->wakeLatency;
+
+  if (allThreads)
+      for (Thread* th : *this)
+          latency = std::max(latency, th->wakeLatency);
+
+  return latency;
+}
+
+
+/// ThreadPool::restore_root_moves() keeps the root moves ordering read from a
+/// checkpoint, to be used by the next search if it starts from the position
+/// with the given key.
+
+void ThreadPool::restore_root_moves(Key key, const Search::RootMoves& rootMoves) {
+
+  restoredKey = key;
+  restoredRootMoves = rootMoves;
+}
+
+
+/// ThreadPool::continue_search() checks whether the game went on along the PV
+/// of the last search, that is our best move and the expected reply. In that
+/// case the expected next move is searched first, the other root moves are
+/// sorted by their hash table score, and the iterations already covered by the
+/// hash table are skipped. Returns the depth the search starts from.
+
+Depth ThreadPool::continue_search(const Position& pos, Search::RootMoves& rootMoves,
+                                  const Search::LimitsType& limits) {
+
+  MainThread* mt = main();
+
+  if (   !limits.use_time_management()
+      ||  Options["MultiPV"] != 1
+      ||  pos.key() != mt->predictedKey
+      ||  rootMoves.size() < 2)
+      return DEPTH_ZERO;
+
+  auto it = std::find(rootMoves.begin(), rootMoves.end(), mt->predictedMove);
+  if (it == rootMoves.end())
+      return DEPTH_ZERO;
+
+  std::rotate(rootMoves.begin(), it, it + 1);
+
+  // Replies with a hash table score come first, best first. The search sorts
+  // the root moves only by the scores it finds, so the order is kept until a
+  // move raises alpha.
+  std::vector<Value> scores;
+  TTEntry ttData;
+  bool found;
+
+  for (const Search::RootMove& rm : rootMoves)
+  {
+      TT.probe(pos.key_after(rm.pv[0]), found, ttData);
+      scores.push_back(found && ttData.value() != VALUE_NONE ? -Search::value_from_tt(ttData.value(), 1)
+                                                             : -VALUE_INFINITE);
+  }
+
+  std::vector<size_t> order(rootMoves.size() - 1);
+  for (size_t i = 0; i < order.size(); ++i)
+      order[i] = i + 1;
+
+  std::stable_sort(order.begin(), order.end(),
+                   [&](size_t a, size_t b) { return scores[a] > scores[b]; });
+
+  Search::RootMoves sorted(1, rootMoves[0]);
+  for (size_t i : order)
+      sorted.push_back(rootMoves[i]);
+
+  rootMoves = sorted;
+
+  // The aspiration window of the first iteration is centered on the score of
+  // the last search, which was given from the point of view of the same side.
+  rootMoves[0].score = mt->previousScore;
+
+  // Restart a couple of plies below what the hash table still holds for the
+  // root, in case the entry has been overwritten since the last search.
+  TT.probe(pos.key(), found, ttData);
+  if (!found || ttData.move() != mt->predictedMove)
+      return DEPTH_ZERO;
+
+  return std::max(DEPTH_ZERO, std::min(mt->predictedDepth - 2 * ONE_PLY, ttData.depth()) - ONE_PLY);
+}
+
+
 /// ThreadPool::start_thinking() wakes up the main thread sleeping in idle_loop()
 /// and starts a new search, then returns immediately.
 
@@ -164,6 +414,7 @@ void ThreadPool::start_thinking(Position& pos, StateListPtr& states,
 
   main()->wait_for_search_finished();
 
+  goTime = std::chrono::steady_clock::now();
   Search::Signals.stopOnPonderhit = Search::Signals.stop = false;
   Search::Limits = limits;
   Search::RootMoves rootMoves;
@@ -175,7 +426,28 @@ void ThreadPool::start_thinking(Position& pos, StateListPtr& states,
 		  
   if (!rootMoves.empty())
 	  Tablebases::filter_root_moves(pos, rootMoves);
-  
+
+  // Resume a restored analysis with its root moves ordering, moves that are
+  // not in the restored list keep their place after the restored ones.
+  if (!restoredRootMoves.empty() && pos.key() == restoredKey)
+  {
+      Search::RootMoves ordered;
+
+      for (const Search::RootMove& rm : restoredRootMoves)
+      {
+          auto it = std::find(rootMoves.begin(), rootMoves.end(), rm.pv[0]);
+          if (it != rootMoves.end())
+              ordered.push_back(*it), rootMoves.erase(it);
+      }
+
+      ordered.insert(ordered.end(), rootMoves.begin(), rootMoves.end());
+      rootMoves = ordered;
+  }
+
+  restoredRootMoves.clear();
+
+  Depth startDepth = continue_search(pos, rootMoves, limits);
+
   // After ownership transfer 'states' becomes empty, so if we stop the search
   // and call 'go' again without setting a new position states.get() == NULL.
   assert(states.get() || setupStates.get());
@@ -183,17 +455,19 @@ void ThreadPool::start_thinking(Position& pos, StateListPtr& states,
   if (states.get())
       setupStates = std::move(states); // Ownership transfer, states is now empty
 
-  StateInfo tmp = setupStates->back();
+  setupPos.set(pos, &setupStates->back(), main());
+  setupRootMoves = rootMoves;
 
+  // Only what the main thread or a stop may read before a helper has set up
+  // its root is reset here, the rest is done by each thread when it wakes up.
   for (Thread* th : Threads)
   {
       th->maxPly = 0;
-      th->rootDepth = DEPTH_ZERO;
-      th->rootMoves = rootMoves;
-      th->rootPos.set(pos.fen(), pos.is_chess960(), &setupStates->back(), th);
+      th->rootDepth = startDepth;
+      th->completedDepth = DEPTH_ZERO;
+      th->goLatency = th->wakeLatency = 0;
+      th->rootPos.set_nodes_searched(0);
   }
 
-  setupStates->back() = tmp; // Restore st->previous, cleared by Position::set()
-
   main()->start_searching();
 }
@@ -12,7 +12,9 @@
 
 #include <atomic>
 #include <bitset>
+#include <chrono>
 #include <condition_variable>
+#include <functional>
 #include <mutex>
 #include <thread>
 #include <vector>
@@ -23,6 +25,7 @@
 #include "positioning.h"
 #include "searching.h"
 #include "threaded_win32.h"
+#include "transpositiontable.h"
 
 
 /// Thread struct keeps together all the thread-related stuff. We also use
@@ -36,6 +39,11 @@ class Thread {
   Mutex mutex;
   ConditionVariable sleepCondition;
   bool exit, searching;
+  std::atomic<uint64_t> epoch; // Bumped at each wake up, polled while spinning
+  std::chrono::steady_clock::time_point wakeTime;
+  std::function<void()> task; // Run instead of a search when set
+
+  template<typename Predicate> bool spin(Predicate done);
 
 public:
   Thread();
@@ -43,23 +51,31 @@ public:
   virtual void search();
   void idle_loop();
   void start_searching(bool resume = false);
+  void execute(std::function<void()> f);
   void wait_for_search_finished();
+  bool is_searching();
   void wait(std::atomic_bool& b);
 
   Pawns::Table pawnsTable;
   Material::Table materialTable;
   Endgames endgames;
   size_t idx, PVIdx;
-  int maxPly, callsCnt;
+  int maxPly;
 
   Position rootPos;
+  StateInfo rootState;
+  int64_t goLatency;   // Microseconds from 'go' to the first node
+  int64_t wakeLatency; // Microseconds from start_searching() to the wake up
   Search::RootMoves rootMoves;
   Depth rootDepth;
   Depth completedDepth;
-  std::atomic_bool resetCalls;
   HistoryStats history;
   MoveStats counterMoves;
   CounterMoveHistoryStats counterMoveHistory;
+  QSTable qsTable;
+  QSTable syncBuffer; // TT writes between two sync points, in deterministic mode
+  TTStats ttStats;
+  Search::PruneStats pruneStats;
 };
 
 
@@ -71,6 +87,9 @@ struct MainThread : public Thread {
   bool easyMovePlayed, failedLow;
   double bestMoveChanges;
   Value previousScore;
+  Key predictedKey = 0;
+  Move predictedMove;
+  Depth predictedDepth;
 };
 
 
@@ -86,10 +105,27 @@ struct ThreadPool : public std::vector<Thread*> {
   MainThread* main() { return static_cast<MainThread*>(at(0)); }
   void start_thinking(Position&, StateListPtr&, const Search::LimitsType&);
   void read_uci_options();
+  void execute(const std::function<void(size_t idx)>& f, Thread* self = nullptr);
   int64_t nodes_searched();
+  TTStats tt_stats();
+  Search::PruneStats prune_stats();
+  void restore_root_moves(Key key, const Search::RootMoves& rootMoves);
+  int64_t go_latency(bool allThreads);
+  int64_t wake_latency(bool allThreads);
+
+  // Copied by each thread into its own root when it wakes up to search
+  Position setupPos;
+  Search::RootMoves setupRootMoves;
+  std::chrono::steady_clock::time_point goTime;
+  int spinTime; // Microseconds an idle thread polls before sleeping
 
 private:
+  Depth continue_search(const Position& pos, Search::RootMoves& rootMoves,
+                        const Search::LimitsType& limits);
+
   StateListPtr setupStates;
+  Key restoredKey;
+  Search::RootMoves restoredRootMoves;
 };
 
 extern ThreadPool Threads;
@@ -7,19 +7,40 @@
   There is no warranty of any kind.
 */
 
+#include <algorithm> // For std::max
+#include <atomic>
+#include <chrono>
 #include <cstring>   // For std::memset
+#include <fstream>
 #include <iostream>
+#include <thread>
+#include <vector>
 
 #include "bitlist.h"
 
+#include "threaded.h"
 #include "ucicommand.h"
 #include "transpositiontable.h"
-#include "windows.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <cerrno>
+#include <fcntl.h>
+#include <signal.h> // For kill()
+#include <linux/mempolicy.h> // For MPOL_INTERLEAVE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 TranspositionTable TT; // Our global transposition table
+thread_local TTStats TTStats::local;
 int use_large_pages = -1;
 int got_privileges = -1;
 
+#if defined(_WIN32)
 
 bool Get_LockMemory_Privileges()
 {
@@ -45,6 +66,19 @@ bool Get_LockMemory_Privileges()
     return ret;
 }
 
+#elif defined(__linux__)
+
+// No privilege is needed on Linux: explicit huge pages come from the pool
+// reserved by the administrator (vm.nr_hugepages) and transparent huge pages
+// are granted by the kernel on request.
+bool Get_LockMemory_Privileges() { return true; }
+
+#else
+
+bool Get_LockMemory_Privileges() { return false; }
+
+#endif
+
 
 void Try_Get_LockMemory_Privileges()
 {
@@ -71,9 +105,350 @@ void Try_Get_LockMemory_Privileges()
 }
 
 
+#if defined(__linux__)
+
+/// Alloc_Huge_Pages() maps 'size' bytes of anonymous memory backed by huge
+/// pages. It first tries explicit hugetlbfs pages, 1GB ones when the size is a
+/// multiple of 1GB and then 2MB ones, and if the pool is empty it falls back
+/// to a 2MB aligned mapping advised for transparent huge pages. On success
+/// 'size' is updated to the length actually mapped, as needed by munmap().
+
+void* Alloc_Huge_Pages(size_t& size, const char*& backing)
+{
+    const size_t HugePageSize = 2 * 1024 * 1024;
+    const int Prot  = PROT_READ | PROT_WRITE;
+    const int Flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void* p;
+
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_1GB)
+    if (size % (512 * HugePageSize) == 0)
+    {
+        p = mmap(NULL, size, Prot, Flags | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0);
+        if (p != MAP_FAILED)
+            return backing = "hugetlbfs 1GB pages", p;
+    }
+#endif
+
+    size = (size + HugePageSize - 1) & ~(HugePageSize - 1);
+
+#if defined(MAP_HUGETLB)
+    p = mmap(NULL, size, Prot, Flags | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+        return backing = "hugetlbfs 2MB pages", p;
+#endif
+
+    // Over-allocate by one huge page and trim both ends, so that the kernel
+    // can back the whole table with aligned transparent huge pages.
+    char* raw = (char*)mmap(NULL, size + HugePageSize, Prot, Flags, -1, 0);
+    if (raw == MAP_FAILED)
+        return NULL;
+
+    char* aligned = (char*)((uintptr_t(raw) + HugePageSize - 1) & ~(HugePageSize - 1));
+
+    if (aligned > raw)
+        munmap(raw, aligned - raw);
+
+    if (raw + HugePageSize > aligned)
+        munmap(aligned + size, raw + HugePageSize - aligned);
+
+#if defined(MADV_HUGEPAGE)
+    if (!madvise(aligned, size, MADV_HUGEPAGE))
+        return backing = "transparent huge pages", aligned;
+#endif
+
+    return backing = "4KB pages (huge pages unavailable)", aligned;
+}
+
+#endif
+
+
+#if defined(__linux__)
+
+/// SegmentHeader is stored in the first cache line of a shared hash segment,
+/// just before the clusters. The magic number identifies the entry format, so
+/// that engines built with another cluster layout refuse to attach. All the
+/// processes advance the same generation, so that an entry saved by one of
+/// them is not seen as old by the others. Each attached process holds one of
+/// the pid slots, a slot whose process has died is freed by the next process
+/// attaching or detaching, so a crash does not keep the segment alive.
+
+const int SegmentMaxUsers = 11;
+
+struct SegmentHeader {
+  std::atomic<uint64_t> magic;
+  uint64_t clusterCount;
+  std::atomic<uint32_t> generation;
+  std::atomic<int32_t> pids[SegmentMaxUsers];
+};
+
+const uint64_t SegmentMagic = 0x48594E4F53545401ULL ^ (sizeof(TTEntry) << 8) ^ TTClusterLayout::Size;
+const size_t SegmentHeaderSize = 64; // A full cache line, to keep clusters aligned
+
+static_assert(sizeof(SegmentHeader) <= SegmentHeaderSize, "Segment header too big");
+
+
+/// Live_Users() frees the pid slots of the processes that are gone and returns
+/// the number of processes still attached to the segment.
+
+int Live_Users(SegmentHeader* header)
+{
+    int users = 0;
+
+    for (std::atomic<int32_t>& slot : header->pids)
+    {
+        int32_t pid = slot;
+
+        if (!pid)
+            continue;
+
+        if (kill(pid, 0) && errno == ESRCH)
+            slot.compare_exchange_strong(pid, 0);
+        else
+            ++users;
+    }
+
+    return users;
+}
+
+
+/// Claim_Slot() records the calling process in a free pid slot. Returns false
+/// if the segment has already SegmentMaxUsers processes attached.
+
+bool Claim_Slot(SegmentHeader* header)
+{
+    Live_Users(header);
+
+    for (std::atomic<int32_t>& slot : header->pids)
+    {
+        int32_t free = 0;
+
+        if (slot.compare_exchange_strong(free, int32_t(getpid())))
+            return true;
+    }
+
+    return false;
+}
+
+
+/// Attach_Segment() maps the named POSIX shared memory segment holding the
+/// table, creating it with room for 'clusterCount' clusters if it does not
+/// exist yet. When attaching to an existing segment 'clusterCount' is set to
+/// the size found there, as all the processes must index the same table.
+/// 'size' receives the length of the mapping and 'created' is true if the
+/// table is new and must be cleared. Returns NULL on failure.
+
+void* Attach_Segment(const std::string& name, size_t& clusterCount, size_t& size, bool& created)
+{
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+
+    created = fd != -1;
+
+    if (!created)
+        fd = shm_open(name.c_str(), O_RDWR, 0600);
+
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    size = SegmentHeaderSize + clusterCount * sizeof(TTClusterLayout);
+
+    if (created && ftruncate(fd, size))
+    {
+        close(fd);
+        shm_unlink(name.c_str());
+        return NULL;
+    }
+
+    // The creator may still be sizing the segment
+    for (int i = 0; !created && i < 1000 && !fstat(fd, &st) && st.st_size == 0; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    if (!created)
+        size = fstat(fd, &st) ? 0 : st.st_size;
+
+    void* mem = size > SegmentHeaderSize ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                                         : MAP_FAILED;
+    close(fd);
+
+    if (mem == MAP_FAILED)
+        return NULL;
+
+    SegmentHeader* header = (SegmentHeader*)mem;
+
+    if (created)
+    {
+        header->clusterCount = clusterCount;
+        Claim_Slot(header);
+        header->magic.store(SegmentMagic, std::memory_order_release);
+        return mem;
+    }
+
+    for (int i = 0; i < 1000 && !header->magic.load(std::memory_order_acquire); ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    if (   header->magic != SegmentMagic
+        || SegmentHeaderSize + header->clusterCount * sizeof(TTClusterLayout) > size)
+    {
+        std::cerr << "Shared hash " << name << " has an incompatible format" << std::endl;
+        munmap(mem, size);
+        return NULL;
+    }
+
+    if (!Claim_Slot(header))
+    {
+        std::cerr << "Shared hash " << name << " has too many users" << std::endl;
+        munmap(mem, size);
+        return NULL;
+    }
+
+    clusterCount = header->clusterCount;
+    return mem;
+}
+
+
+/// Detach_Segment() unmaps a shared hash segment. The last process leaving
+/// removes its name, so that the memory is given back to the system.
+
+void Detach_Segment(void* mem, size_t size, const std::string& name)
+{
+    SegmentHeader* header = (SegmentHeader*)mem;
+
+    for (std::atomic<int32_t>& slot : header->pids)
+    {
+        int32_t pid = getpid();
+        slot.compare_exchange_strong(pid, 0);
+    }
+
+    if (Live_Users(header) == 0 && !name.empty())
+        shm_unlink(name.c_str());
+
+    munmap(mem, size);
+}
+
+#endif
+
+
+/// Interleave_Mem() sets a round robin placement policy over all the online
+/// NUMA nodes for the pages of the given memory range, so that the memory
+/// bandwidth of every socket is used. It must be called before the pages are
+/// touched and returns the number of nodes used, or 0 if not supported.
+
+int Interleave_Mem(void* addr, size_t size)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    const int MaxNodes = 1024;
+    unsigned long nodeMask[MaxNodes / (8 * sizeof(unsigned long))] = {};
+    int nodes = 0, first, last;
+    char sep = ',';
+
+    // The online nodes are listed as ranges, for instance "0-1,4"
+    std::ifstream online("/sys/devices/system/node/online");
+
+    while (sep == ',' && online >> first)
+    {
+        last = first;
+        if (online.get(sep) && sep == '-')
+            online >> last, online.get(sep);
+
+        for (int n = first; n <= std::min(last, MaxNodes - 1); ++n, ++nodes)
+            nodeMask[n / (8 * sizeof(unsigned long))] |= 1UL << (n % (8 * sizeof(unsigned long)));
+    }
+
+    if (nodes < 2)
+        return 0;
+
+    // mbind() wants a page aligned start address, calloc() does not give one
+    uintptr_t page = uintptr_t(sysconf(_SC_PAGESIZE));
+    uintptr_t start = uintptr_t(addr) & ~(page - 1);
+
+    if (syscall(SYS_mbind, start, uintptr_t(addr) + size - start,
+                MPOL_INTERLEAVE, nodeMask, MaxNodes + 1, 0))
+        return 0;
+
+    return nodes;
+#else
+    (void)addr, (void)size;
+    return 0;
+#endif
+}
+
+
+/// Free_Mem() releases the table memory with the deallocator matching the
+/// way it was obtained.
+
+void Free_Mem(void* mem, size_t memSize, bool largePages)
+{
+    if (mem == NULL)
+        return;
+
+    if (!largePages)
+        free(mem);
+    else
+    {
+#if defined(_WIN32)
+        VirtualFree(mem, 0, MEM_RELEASE);
+#elif defined(__linux__)
+        munmap(mem, memSize);
+#endif
+    }
+
+    (void)memSize;
+}
+
+
+/// TranspositionTable destructor leaves the shared hash segment, if any. The
+/// private memory is simply given back to the system by the process exit.
+
+TranspositionTable::~TranspositionTable() {
+
+#if defined(__linux__)
+  if (!segment.empty())
+      Detach_Segment(mem, memSize, segment);
+#endif
+}
+
+
+/// TranspositionTable::new_search() advances the generation at the start of
+/// each search. The stale entries are the ones older than the current game, so
+/// the age limit grows with the generations played since new_game(). Before
+/// the generation wraps around and would make them look young, the stale
+/// entries no probe has erased yet are given back as plain old entries.
+
+void TranspositionTable::new_search() {
+
+#if defined(__linux__)
+  if (!segment.empty())
+      generation8 = uint8_t(((SegmentHeader*)mem)->generation += 4);
+  else
+#endif
+  generation8 += 4; // Lower 2 bits are used by Bound
+
+  if (staleAge != NoStaleAge)
+      staleAge = uint8_t(generation8 - epoch8) >= 0xF8 ? NoStaleAge : uint8_t(generation8 - epoch8);
+}
+
+
+/// TranspositionTable::new_game() starts a new game in constant time. Instead
+/// of clearing the table, all its entries are marked stale by starting a new
+/// epoch. Search treats stale entries as empty, and probe() erases them as it
+/// meets them, so the table is aged lazily by the search itself.
+
+void TranspositionTable::new_game() {
+
+  generation8 += 4;
+  epoch8 = generation8;
+  staleAge = 0;
+}
+
+
 /// TranspositionTable::resize() sets the size of the transposition table,
-/// measured in megabytes. Transposition table consists of a power of 2 number
-/// of clusters and each cluster consists of ClusterSize number of TTEntry.
+/// measured in megabytes. Transposition table consists of as many clusters as
+/// fit in the given size and each cluster consists of ClusterSize number of TTEntry.
+/// The old table is kept until its entries have been moved to the new one, so
+/// that a resize during a long analysis does not throw away the searched tree.
+/// With the 'Hash Segment' option the table lives in a named POSIX shared
+/// memory segment: every engine process attaching to the same name probes and
+/// stores into the same lockless entries, so they share both work and memory.
 
 void TranspositionTable::resize(size_t mbSize) {
 
@@ -87,59 +462,128 @@ void TranspositionTable::resize(size_t mbSize) {
 
   Try_Get_LockMemory_Privileges();
 
-  size_t newClusterCount = size_t(1) << msb((mbSize * 1024 * 1024) / sizeof(Cluster));
+  size_t newClusterCount = mbSize * 1024 * 1024 / sizeof(Cluster);
+
+  int newNumaPolicy =  Options["NUMA Policy"] == "Interleave" ? NUMA_INTERLEAVE
+                     : Options["NUMA Policy"] == "Local"      ? NUMA_LOCAL
+                                                              : NUMA_FIRST_TOUCH;
 
-  if (newClusterCount == clusterCount)
+  std::string newSegment = Options["Hash Segment"];
+
+  if (newSegment == "<empty>")
+      newSegment.clear();
+
+  else if (newSegment[0] != '/')
+      newSegment = "/" + newSegment;
+
+  if (newClusterCount == clusterCount && newNumaPolicy == numaPolicy && newSegment == segment)
   {
+      if (!segment.empty())
+          return;
       if ((use_large_pages == 1) && (large_pages_used))      
           return;
       if ((use_large_pages == 0) && (large_pages_used == false))
           return;
   }
 
-  clusterCount = newClusterCount;
- 
-  if (use_large_pages < 1)
+  Cluster* oldTable = table;
+  size_t oldClusterCount = clusterCount;
+  void* oldMem = mem;
+  size_t oldMemSize = memSize;
+  bool oldLargePages = large_pages_used;
+  std::string oldSegment = segment;
+  bool oldShared = !segment.empty();
+  bool created = true;
+
+#if defined(__linux__)
+  // The segment can be rebuilt with another size only if we are its only user,
+  // then the name is released now, so that the segment is created anew.
+  if (!segment.empty() && newSegment == segment)
   {
-      if (mem != NULL)
+      if (Live_Users((SegmentHeader*)mem) > 1)
       {
-          if (large_pages_used)
-              VirtualFree(mem, 0, MEM_RELEASE);
-          else          
-              free(mem);
+          sync_cout << "info string Hash size is set by shared segment " << segment << sync_endl;
+          return;
       }
-      uint64_t memsize = clusterCount * sizeof(Cluster) + CacheLineSize - 1;
-      mem = calloc(memsize, 1);
-      large_pages_used = false;
+
+      shm_unlink(segment.c_str());
+      oldSegment.clear();
   }
-  else
+#endif
+
+  clusterCount = newClusterCount;
+  numaPolicy = newNumaPolicy;
+  segment = newSegment;
+  mem = NULL;
+
+#if defined(__linux__)
+  if (!segment.empty())
   {
-      if (mem != NULL)
+      mem = Attach_Segment(segment, clusterCount, memSize, created);
+
+      if (mem == NULL)
+      {
+          std::cerr << "Failed to attach shared hash " << segment
+                    << ", switching to private memory" << std::endl;
+          clusterCount = newClusterCount;
+          segment.clear();
+      }
+      else
       {
-          if (large_pages_used)
-              VirtualFree(mem, 0, MEM_RELEASE);
+#if defined(MADV_HUGEPAGE)
+          madvise(mem, memSize, MADV_HUGEPAGE); // Honoured if shmem_enabled allows
+#endif
+          memBacking = "shared memory";
+          large_pages_used = false;
+          table = (Cluster*)((char*)mem + SegmentHeaderSize);
+
+          SegmentHeader* header = (SegmentHeader*)mem;
+
+          if (created)
+              header->generation = generation8;
           else
-              free(mem);
+              generation8 = uint8_t(header->generation);
+
+          sync_cout << "info string Hash " << clusterCount * sizeof(Cluster) / (1024 * 1024)
+                    << " MB " << (created ? "created" : "attached") << " in shared segment "
+                    << segment << sync_endl;
       }
+  }
+#else
+  segment.clear();
+#endif
+
+  if (mem == NULL && use_large_pages == 1)
+  {
+      memSize = clusterCount * sizeof(Cluster);
+
+#if defined(_WIN32)
+      mem = VirtualAlloc(NULL, memSize, MEM_LARGE_PAGES | MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+      memBacking = "large pages";
+#elif defined(__linux__)
+      mem = Alloc_Huge_Pages(memSize, memBacking);
+#endif
 
-      int64_t memsize = clusterCount * sizeof(Cluster);
-      mem = VirtualAlloc(NULL, memsize, MEM_LARGE_PAGES | MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
       if (mem == NULL)
       {
           std::cerr << "Failed to allocate " << mbSize
               << "MB Large Page Memory for transposition table, switching to default" << std::endl;
 
           use_large_pages = 0;
-          memsize = clusterCount * sizeof(Cluster) + CacheLineSize - 1;
-          mem = calloc(memsize, 1);
-          large_pages_used = false;
       }
       else
       {
-          sync_cout << "Hash LargePages " << (memsize >> 20) << " Mb" << sync_endl;
+          sync_cout << "info string Hash " << mbSize << " MB on " << memBacking << sync_endl;
           large_pages_used = true;
       }
-        
+  }
+
+  if (mem == NULL && use_large_pages < 1)
+  {
+      memSize = clusterCount * sizeof(Cluster) + CacheLineSize - 1;
+      mem = calloc(memSize, 1);
+      memBacking = "default pages";
+      large_pages_used = false;
   }
 
   if (!mem)
@@ -149,17 +593,215 @@ void TranspositionTable::resize(size_t mbSize) {
       exit(EXIT_FAILURE);
   }
 
-  table = (Cluster*)((uintptr_t(mem) + CacheLineSize - 1) & ~(CacheLineSize - 1));
+  if (segment.empty())
+      table = (Cluster*)((uintptr_t(mem) + CacheLineSize - 1) & ~(CacheLineSize - 1));
+
+  if (numaPolicy == NUMA_INTERLEAVE && created)
+  {
+      int nodes = Interleave_Mem(mem, memSize);
+
+      if (nodes)
+          sync_cout << "info string Hash interleaved over " << nodes << " NUMA nodes" << sync_endl;
+      else
+          sync_cout << "info string NUMA interleave not available, using first touch" << sync_endl;
+  }
+
+  // The first write to a page decides the NUMA node it is placed on. An
+  // existing shared segment holds the work of the other processes.
+  if (created)
+      clear();
+
+  if (oldMem)
+  {
+      TimePoint elapsed = now();
+      size_t kept = transfer(oldTable, oldClusterCount);
+
+#if defined(__linux__)
+      if (oldShared)
+          Detach_Segment(oldMem, oldMemSize, oldSegment);
+      else
+#endif
+      Free_Mem(oldMem, oldMemSize, oldLargePages);
+
+      sync_cout << "info string Hash kept " << kept << " entries in "
+                << now() - elapsed << " ms" << sync_endl;
+  }
+
+  staleAge = NoStaleAge;
+}
+
+
+/// TranspositionTable::transfer() moves the entries of an old table into the
+/// current one, in parallel on the search threads. When entries
+/// compete for a cluster the most valuable ones, by depth and age, are kept.
+/// As mul_hi64() is monotonic in the key, a contiguous slice of the old table
+/// lands in a contiguous slice of the new one, so the threads only overlap at
+/// the slice boundaries. Returns the number of entries moved.
+
+size_t TranspositionTable::transfer(const Cluster* oldTable, size_t oldClusterCount) {
+
+  // Without the full key an entry can not be placed in a table of another size
+  if (!TTEntry::FullKey)
+      return 0;
+
+  size_t threadCount = std::max(Threads.size(), size_t(1));
+  size_t stride = oldClusterCount / threadCount;
+  std::vector<size_t> kept(threadCount);
+
+  auto place = [=, &kept](size_t idx) {
+
+      size_t start = stride * idx;
+      size_t end = idx != threadCount - 1 ? start + stride : oldClusterCount;
+
+      for (size_t i = start; i < end; ++i)
+          for (const TTEntry& e : oldTable[i].entry)
+          {
+              if (e.empty() || stale(e))
+                  continue;
+
+              Key key = e.key();
+              TTEntry* const tte = first_entry(key);
+              TTEntry* replace = nullptr;
+
+              for (int j = 0; j < ClusterSize && !replace; ++j)
+                  if (tte[j].empty())
+                      replace = &tte[j], ++kept[idx];
+
+              if (!replace)
+              {
+                  replace = tte;
+                  for (int j = 1; j < ClusterSize; ++j)
+                      if (replace_value(*replace) > replace_value(tte[j]))
+                          replace = &tte[j];
+
+                  if (replace_value(e) <= replace_value(*replace))
+                      continue;
+              }
+
+              replace->assign(key, e);
+          }
+  };
+
+  // As in clear(), the caller does all the work while a search runs
+  if (Threads.empty() || Threads.main()->is_searching())
+      for (size_t idx = 0; idx < threadCount; ++idx)
+          place(idx);
+  else
+      Threads.execute(place);
+
+  size_t total = 0;
+  for (size_t k : kept)
+      total += k;
+
+  return total;
 }
 
 
 /// TranspositionTable::clear() overwrites the entire transposition table
 /// with zeros. It is called whenever the table is resized, or when the
 /// user asks the program to clear the table (from the UCI interface).
+/// Unless the NUMA policy is Local, the table is split in one slice per
+/// search thread and each slice is cleared by its search thread, so that
+/// when the table has just been allocated its pages are first touched, and
+/// placed, on the nodes where the search threads run. While a search runs the
+/// threads are busy, and waiting for them would block the UI thread until the
+/// search ends, so the caller clears the whole table itself.
 
 void TranspositionTable::clear() {
 
-  std::memset(table, 0, clusterCount * sizeof(Cluster));
+  staleAge = NoStaleAge;
+
+  size_t threadCount =  numaPolicy == NUMA_LOCAL || Threads.empty() || Threads.main()->is_searching()
+                      ? 1 : Threads.size();
+  size_t stride = clusterCount / threadCount;
+
+  auto wipe = [this, stride, threadCount](size_t idx) {
+
+      size_t start = stride * idx;
+      size_t len = idx != threadCount - 1 ? stride : clusterCount - start;
+
+      std::memset(&table[start], 0, len * sizeof(Cluster));
+  };
+
+  if (threadCount == 1)
+      wipe(0);
+  else
+      Threads.execute(wipe);
+}
+
+
+/// TranspositionTable::dump() writes the table to a binary stream: the number
+/// of clusters and the generation, then the clusters as they are in memory,
+/// in large sequential writes. Entries are copied while other threads may be
+/// writing them: a torn entry does not verify and is read back as a miss.
+
+void TranspositionTable::dump(std::ostream& os) {
+
+  // Don't save stale entries. The search is stopped, so no thread writes here
+  if (staleAge != NoStaleAge)
+      for (size_t i = 0; i < clusterCount; ++i)
+          for (TTEntry& e : table[i].entry)
+              if (!e.empty() && stale(e))
+                  e.erase();
+
+  const size_t ChunkSize = 64 * 1024 * 1024;
+  const uint64_t header[] = { clusterCount, generation8 };
+  const size_t size = clusterCount * sizeof(Cluster);
+
+  os.write((const char*)header, sizeof(header));
+
+  for (size_t done = 0; done < size && os; done += ChunkSize)
+      os.write((const char*)table + done, std::min(ChunkSize, size - done));
+}
+
+
+/// TranspositionTable::load() reads a table written by dump(). A table of the
+/// same size is read straight into place. Otherwise, when the entries keep the
+/// full key, the clusters are read in chunks and moved to their new place by
+/// transfer(). Returns false if the stream fails or the sizes can't be mixed.
+
+bool TranspositionTable::load(std::istream& is) {
+
+  const size_t ChunkClusters = 64 * 1024 * 1024 / sizeof(Cluster);
+  uint64_t header[2];
+
+  if (!is.read((char*)header, sizeof(header)))
+      return false;
+
+  if (header[0] != clusterCount && !TTEntry::FullKey)
+      return false;
+
+  clear();
+  generation8 = uint8_t(header[1]);
+
+#if defined(__linux__)
+  if (!segment.empty())
+      ((SegmentHeader*)mem)->generation = generation8;
+#endif
+
+  if (header[0] == clusterCount)
+  {
+      for (size_t done = 0; done < clusterCount && is; done += ChunkClusters)
+          is.read((char*)&table[done], std::min(ChunkClusters, clusterCount - done) * sizeof(Cluster));
+
+      return bool(is);
+  }
+
+  // The chunk is read into a buffer aligned as the table, as clusters need
+  std::vector<char> raw(ChunkClusters * sizeof(Cluster) + CacheLineSize - 1);
+  Cluster* buffer = (Cluster*)((uintptr_t(raw.data()) + CacheLineSize - 1) & ~(CacheLineSize - 1));
+
+  for (size_t done = 0; done < header[0]; done += ChunkClusters)
+  {
+      size_t count = std::min(size_t(ChunkClusters), size_t(header[0] - done));
+
+      if (!is.read((char*)buffer, count * sizeof(Cluster)))
+          return false;
+
+      transfer(buffer, count);
+  }
+
+  return true;
 }
 
 
@@ -168,33 +810,132 @@ void TranspositionTable::clear() {
 /// Otherwise, it returns false and a pointer to an empty or least valuable TTEntry
 /// to be replaced later. The replace value of an entry is calculated as its depth
 /// minus 8 times its relative age. TTEntry t1 is considered more valuable than
-/// TTEntry t2 if its replace value is greater than that of t2.
+/// TTEntry t2 if its replace value is greater than that of t2. On a hit 'ttData'
+/// receives a copy of the verified entry: the search must read from this copy
+/// and not from the returned pointer, which other threads may overwrite.
+
+TTEntry* TranspositionTable::probe(const Key key, bool& found, TTEntry& ttData) const {
+
+  TTStats& stats = TTStats::local;
+  TTEntry* tte = probe(first_entry(key), key, found, ttData);
+
+  ++stats.probes;
+  stats.hits += found;
+
+  return tte;
+}
+
+
+/// TranspositionTable::probe() with a QSTable looks up the position in the
+/// given small tier instead of the main table, with the same rules.
+
+TTEntry* TranspositionTable::probe(const QSTable& qsTable, const Key key, bool& found, TTEntry& ttData) const {
+
+  TTStats& stats = TTStats::local;
+  TTEntry* tte = probe(qsTable.first_entry(key), key, found, ttData);
+
+  ++stats.qsProbes;
+  stats.qsHits += found;
+
+  return tte;
+}
+
+
+/// TranspositionTable::probe_buffered() is used in deterministic mode, when
+/// the main table is read only during an iteration. The position is looked up
+/// in the thread's buffer and then in the main table, and the returned entry
+/// to save() to is always in the buffer.
+
+TTEntry* TranspositionTable::probe_buffered(const QSTable& buffer, const Key key, bool& found, TTEntry& ttData) const {
+
+  TTEntry* tte = probe(buffer, key, found, ttData);
+
+  if (!found)
+      probe(key, found, ttData);
+
+  return tte;
+}
+
 
-TTEntry* TranspositionTable::probe(const Key key, bool& found) const {
+/// TranspositionTable::merge() saves the entries of the deterministic mode
+/// buffers into one slice of the main table, out of 'slices' equal ones. The
+/// threads merge their slices in parallel at a sync point. Each slice takes
+/// the entries of all the buffers in the same order, so that the table always
+/// ends up the same. The buffer index and mul_hi64() are both monotonic in the
+/// key, so only the buffer clusters that can map into the slice are scanned.
+/// Without the full key the entries can not be placed and are just dropped.
 
-  TTEntry* const tte = first_entry(key);
-  const uint16_t key16 = key >> 48;  // Use the high 16 bits as key inside the cluster
+void TranspositionTable::merge(const std::vector<QSTable*>& buffers, size_t slice, size_t slices) {
+
+  if (!TTEntry::FullKey)
+      return;
+
+  const size_t lo = clusterCount * slice / slices;
+  const size_t hi = clusterCount * (slice + 1) / slices;
+
+  for (const QSTable* buffer : buffers)
+  {
+      const int bits = buffer->sizeBits;
+      const size_t first = (uint64_t(lo) << bits) / clusterCount;
+      const size_t last = std::min(((uint64_t(hi) << bits) + clusterCount - 1) / clusterCount,
+                                   uint64_t(bits ? size_t(1) << bits : 0));
+
+      for (size_t i = first; i < last; ++i)
+          for (const TTEntry& e : buffer->table[i].entry)
+          {
+              if (e.empty())
+                  continue;
+
+              Key key = e.key();
+              size_t c = mul_hi64(key, clusterCount);
+
+              if (c < lo || c >= hi)
+                  continue;
+
+              bool found;
+              TTEntry ttData;
+
+              probe(&table[c].entry[0], key, found, ttData)->save(key, e.value(), e.bound(),
+                                                                 e.depth(), e.move(), e.eval(), generation8);
+          }
+  }
+}
+
+
+/// TranspositionTable::probe() with a cluster does the actual lookup, in the
+/// given cluster of the main table or of a QSTable.
+
+TTEntry* TranspositionTable::probe(TTEntry* const tte, const Key key, bool& found, TTEntry& ttData) const {
 
   for (int i = 0; i < ClusterSize; ++i)
-      if (!tte[i].key16 || tte[i].key16 == key16)
+  {
+      if (tte[i].load(key, ttData) || stale(ttData))
       {
-          if ((tte[i].genBound8 & 0xFC) != generation8 && tte[i].key16)
-              tte[i].genBound8 = uint8_t(generation8 | tte[i].bound()); // Refresh
+          found = !ttData.empty() && !stale(ttData);
+
+          if (!found && !ttData.empty())
+              tte[i].erase(), ttData = TTEntry(); // Stale, so that save() does not merge
+
+          if ((ttData.genBound8() & 0xFC) != generation8 && found)
+              tte[i].refresh(key, ttData, generation8); // Refresh
 
-          return found = (bool)tte[i].key16, &tte[i];
+          return &tte[i];
       }
 
+      // With only 16 bits of the key stored, this would be a hit. The high
+      // bits select the cluster, so the low ones are the meaningful check.
+      if (uint16_t(tte[i].key()) == uint16_t(key))
+          ++TTStats::local.falseHits16;
+  }
+
   // Find an entry to be replaced according to the replacement strategy
   TTEntry* replace = tte;
   for (int i = 1; i < ClusterSize; ++i)
-      // Due to our packed storage format for generation and its cyclic
-      // nature we add 259 (256 is the modulus plus 3 to keep the lowest
-      // two bound bits from affecting the result) to calculate the entry
-      // age correctly even after generation8 overflows into the next cycle.
-      if (  replace->depth8 - ((259 + generation8 - replace->genBound8) & 0xFC) * 2 * ONE_PLY
-          >   tte[i].depth8 - ((259 + generation8 -   tte[i].genBound8) & 0xFC) * 2 * ONE_PLY)
+      if (replace_value(*replace) > replace_value(tte[i]))
           replace = &tte[i];
 
+  ttData = TTEntry();
+
   return found = false, replace;
 }
 
@@ -209,8 +950,52 @@ int TranspositionTable::hashfull() const
   {
       const TTEntry* tte = &table[i].entry[0];
       for (int j = 0; j < ClusterSize; j++)
-          if ((tte[j].genBound8 & 0xFC) == generation8)
+          if ((tte[j].genBound8() & 0xFC) == generation8)
               cnt++;
   }
   return cnt;
 }
+
+
+/// TTStats::operator+=() sums up the counters of several threads or searches
+
+TTStats& TTStats::operator+=(const TTStats& s) {
+
+  probes        += s.probes;
+  hits          += s.hits;
+  falseHits16   += s.falseHits16;
+  saves         += s.saves;
+  filled        += s.filled;
+  replacedAge   += s.replacedAge;
+  replacedDepth += s.replacedDepth;
+  rejected      += s.rejected;
+  qsProbes      += s.qsProbes;
+  qsHits        += s.qsHits;
+
+  return *this;
+}
+
+
+/// operator<<(TTStats) prints the counters, with rates where meaningful
+
+std::ostream& operator<<(std::ostream& os, const TTStats& s) {
+
+  auto pct = [](uint64_t n, uint64_t total) {
+    return total ? 100.0 * n / total : 0.0;
+  };
+
+  os << "TT probes       : " << s.probes
+     << "\nTT hits         : " << s.hits << " (" << pct(s.hits, s.probes) << "%)"
+     << "\nTT false hits16 : " << s.falseHits16 << " (" << pct(s.falseHits16, s.probes) << "%)"
+     << "\nTT saves        : " << s.saves
+     << "\nTT filled       : " << s.filled << " (" << pct(s.filled, s.saves) << "%)"
+     << "\nTT repl. by age : " << s.replacedAge << " (" << pct(s.replacedAge, s.saves) << "%)"
+     << "\nTT repl. depth  : " << s.replacedDepth << " (" << pct(s.replacedDepth, s.saves) << "%)"
+     << "\nTT rejected     : " << s.rejected << " (" << pct(s.rejected, s.saves) << "%)";
+
+  if (s.qsProbes)
+      os << "\nQS tier probes  : " << s.qsProbes
+         << "\nQS tier hits    : " << s.qsHits << " (" << pct(s.qsHits, s.qsProbes) << "%)";
+
+  return os;
+}
@@ -10,100 +10,376 @@
 #ifndef TRASPOSITIONTABLE_H_INCLUDED
 #define TRASPOSITIONTABLE_H_INCLUDED
 
+#include <atomic>
+#include <cstdlib>   // For std::calloc
+#include <cstring>   // For std::memset
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
 #include "mixed.h"
 #include "typeskind.h"
 
-/// TTEntry struct is the 10 bytes transposition table entry, defined as below:
+/// TTStats struct counts what happens in the transposition table. Each thread
+/// updates its own thread_local copy, so counting needs no atomic operation
+/// and no cache line is shared among the threads. A search thread copies its
+/// counters out at the end of each search, see Thread::search().
+
+struct TTStats {
+
+  void clear() { std::memset(this, 0, sizeof(TTStats)); }
+  TTStats& operator+=(const TTStats& s);
+
+  uint64_t probes;        // Calls to probe() on the main table
+  uint64_t hits;          // Probes that found a verified entry
+  uint64_t falseHits16;   // Probes that a 16 bit key check would have mistaken for a hit
+  uint64_t saves;         // Calls to save()
+  uint64_t filled;        // Saves into an empty entry
+  uint64_t replacedAge;   // Saves over another position from an older search
+  uint64_t replacedDepth; // Saves over another position from the current search
+  uint64_t rejected;      // Saves of the same position dropped by the depth rule
+  uint64_t qsProbes;      // Calls to probe() on a QSTable
+  uint64_t qsHits;        // Those that found a verified entry
+
+  static thread_local TTStats local;
+};
+
+std::ostream& operator<<(std::ostream& os, const TTStats& s);
+
+
+/// LocklessEntry struct is the 16 bytes transposition table entry. All the
+/// data of an entry is packed in a single 64 bit word, defined as below:
 ///
-/// key        16 bit
 /// move       16 bit
 /// value      16 bit
 /// eval value 16 bit
 /// generation  6 bit
 /// bound type  2 bit
 /// depth       8 bit
+///
+/// The other 64 bit word stores the full position key XOR-ed with the data
+/// word. Entries are read and written by all the threads without any lock: if
+/// a reader sees the two halves of different writes the key does not verify
+/// and the entry is treated as a miss, so a torn entry never reaches search.
+
+struct LocklessEntry {
+
+  static const bool FullKey = true; // The position key can be recovered
+
+  Move  move()  const { return (Move )(uint16_t)(data64); }
+  Value value() const { return (Value)( int16_t)(data64 >> 16); }
+  Value eval()  const { return (Value)( int16_t)(data64 >> 32); }
+  Depth depth() const { return (Depth)(  int8_t)(data64 >> 56); }
+  Bound bound() const { return (Bound)(genBound8() & 0x3); }
+
+  void save(Key k, Value v, Bound b, Depth d, Move m, Value ev, uint8_t g) {
+
+    const uint64_t old = data64; // Read once, the entry can change under our feet
+    const bool sameKey = (keyXorData64 ^ old) == k;
+    const Move oldMove = (Move)(uint16_t)(old);
+    TTStats& stats = TTStats::local;
+
+    ++stats.saves;
+
+    // Preserve any existing move for the same position
+    if (!m && sameKey)
+        m = oldMove;
+
+    // Don't overwrite more valuable entries
+    if (   !sameKey
+        || d > (int8_t)(old >> 56) - 4
+     /* || g != (genBound8 & 0xFC) // Matching non-zero keys are already refreshed by probe() */
+        || b == BOUND_EXACT)
+    {
+        if (!sameKey)
+            ++(!old ? stats.filled : (uint8_t)(old >> 48 & 0xFC) != g ? stats.replacedAge
+                                                                    : stats.replacedDepth);
+
+        write(k, pack(m, v, ev, uint8_t(g | b), d));
+    }
+    else
+    {
+        ++stats.rejected;
+
+        if (m != oldMove)
+            write(k, (old & ~uint64_t(0xFFFF)) | uint16_t(m));
+    }
+  }
+
+private:
+  friend class TranspositionTable;
+
+  bool empty() const { return !data64; }
+  void erase() { write(0, 0); }
+  uint8_t genBound8() const { return (uint8_t)(data64 >> 48); }
+  Key key() const { return keyXorData64 ^ data64; }
+
+  // Verify the very same data word that is handed to the search
+  bool load(Key k, LocklessEntry& copy) const {
+    const uint64_t data = data64;
+    copy.data64 = data;
+    copy.keyXorData64 = k ^ data;
+    return !data || (keyXorData64 ^ data) == k;
+  }
+
+  void refresh(Key k, const LocklessEntry& copy, uint8_t g) {
+    write(k, (copy.data64 & ~(uint64_t(0xFC) << 48)) | uint64_t(g) << 48);
+  }
+
+  void assign(Key k, const LocklessEntry& e) { write(k, e.data64); }
+
+  static uint64_t pack(Move m, Value v, Value ev, uint8_t genBound, Depth d) {
+    return  uint64_t(uint16_t(m))
+          | uint64_t(uint16_t(v))  << 16
+          | uint64_t(uint16_t(ev)) << 32
+          | uint64_t(genBound)     << 48
+          | uint64_t(uint8_t(d))   << 56;
+  }
+
+  // Data first: a reader racing with us sees a key that does not verify
+  void write(Key k, uint64_t data) {
+    data64 = data;
+    keyXorData64 = k ^ data;
+  }
+
+  uint64_t keyXorData64;
+  uint64_t data64;
+};
+
 
-struct TTEntry {
+/// PackedEntry struct is the compact transposition table entry, 10 bytes with
+/// a 16 bit key check or 12 bytes with a 32 bit one. Only the low bits of the
+/// key are stored, the high ones already select the cluster. Reads and writes
+/// are not atomic, so probe() hands the search a copy that is at least
+/// consistent in the bound: a value torn away from its entry is not trusted.
+
+template<typename KeyBits>
+struct PackedEntry {
+
+  static const bool FullKey = false;
 
   Move  move()  const { return (Move )move16; }
   Value value() const { return (Value)value16; }
   Value eval()  const { return (Value)eval16; }
   Depth depth() const { return (Depth)depth8; }
-  Bound bound() const { return (Bound)(genBound8 & 0x3); }
+  Bound bound() const { return (Bound)(genBound & 0x3); }
 
   void save(Key k, Value v, Bound b, Depth d, Move m, Value ev, uint8_t g) {
 
+    const KeyBits kb = KeyBits(k);
+    TTStats& stats = TTStats::local;
+
+    ++stats.saves;
+
     // Preserve any existing move for the same position
-    if (m || (k >> 48) != key16)
+    if (m || kb != keyBits)
         move16 = (uint16_t)m;
 
     // Don't overwrite more valuable entries
-    if (  (k >> 48) != key16
+    if (   kb != keyBits
         || d > depth8 - 4
-     /* || g != (genBound8 & 0xFC) // Matching non-zero keys are already refreshed by probe() */
         || b == BOUND_EXACT)
     {
-        key16     = (uint16_t)(k >> 48);
-        value16   = (int16_t)v;
-        eval16    = (int16_t)ev;
-        genBound8 = (uint8_t)(g | b);
-        depth8    = (int8_t)d;
+        if (kb != keyBits)
+            ++(!keyBits ? stats.filled : (genBound & 0xFC) != g ? stats.replacedAge
+                                                                : stats.replacedDepth);
+
+        keyBits  = kb;
+        value16  = (int16_t)v;
+        eval16   = (int16_t)ev;
+        genBound = (uint8_t)(g | b);
+        depth8   = (int8_t)d;
     }
+    else
+        ++stats.rejected;
   }
 
 private:
   friend class TranspositionTable;
 
-  uint16_t key16;
+  bool empty() const { return !keyBits; }
+  void erase() { keyBits = 0; }
+  uint8_t genBound8() const { return genBound; }
+  Key key() const { return keyBits; }
+
+  bool load(Key k, PackedEntry& copy) const {
+    copy = *this;
+    if (copy.value16 == VALUE_NONE)
+        copy.genBound &= 0xFC; // BOUND_NONE
+    return !copy.keyBits || copy.keyBits == KeyBits(k);
+  }
+
+  void refresh(Key, const PackedEntry& copy, uint8_t g) {
+    genBound = uint8_t(g | (copy.genBound & 0x3));
+  }
+
+  void assign(Key, const PackedEntry& e) { *this = e; }
+
+  KeyBits  keyBits;
   uint16_t move16;
   int16_t  value16;
   int16_t  eval16;
-  uint8_t  genBound8;
+  uint8_t  genBound;
   int8_t   depth8;
 };
 
 
-/// A TranspositionTable consists of a power of 2 number of clusters and each
-/// cluster consists of ClusterSize number of TTEntry. Each non-empty entry
-/// contains information of exactly one position. The size of a cluster should
-/// divide the size of a cache line size, to ensure that clusters never cross
-/// cache lines. This ensures best cache performance, as the cacheline is
-/// prefetched, as soon as possible.
+/// TTCluster is the cluster geometry policy: N entries of type E stored in a
+/// cluster of Bytes bytes, padding included. The bytes should divide the size
+/// of a cache line, to ensure that clusters never cross cache lines.
+
+template<typename E, int N, int Bytes>
+struct alignas(Bytes) TTCluster {
+
+  static_assert(N * sizeof(E) <= Bytes, "Too many entries for the cluster");
+
+  typedef E Entry;
+  static const int Size = N;
+
+  E entry[N];
+};
+
+
+/// The cluster layout is selected at compile time with the Makefile variable
+/// 'ttcluster'. The default keeps full keys, the others trade key bits for
+/// more entries per cache line.
+
+#if defined(TT_CLUSTER_3X10)
+typedef TTCluster<PackedEntry<uint16_t>, 3, 32> TTClusterLayout;
+const char* const TTLayoutName = "3x10 bytes, 16 bit key, 32 bytes";
+#elif defined(TT_CLUSTER_6X10)
+typedef TTCluster<PackedEntry<uint16_t>, 6, 64> TTClusterLayout;
+const char* const TTLayoutName = "6x10 bytes, 16 bit key, 64 bytes";
+#elif defined(TT_CLUSTER_5X12)
+typedef TTCluster<PackedEntry<uint32_t>, 5, 64> TTClusterLayout;
+const char* const TTLayoutName = "5x12 bytes, 32 bit key, 64 bytes";
+#else
+typedef TTCluster<LocklessEntry, 4, 64> TTClusterLayout;
+const char* const TTLayoutName = "4x16 bytes, 64 bit key, 64 bytes";
+#endif
+
+typedef TTClusterLayout::Entry TTEntry;
+
+
+/// QSTable is the small tier of the transposition table, one per thread, for
+/// the entries of the quiescence search. Sized to stay in the L2 cache, it
+/// spares qsearch a memory access for each node and keeps its shallow entries
+/// from evicting the deep ones of the main table. Clusters are selected by the
+/// high bits of the key, like in the main table, as only low bits are stored.
+/// It is allocated only while the 'QSearch Hash' option is on, an empty table
+/// has size 0. In deterministic mode each thread has a second one, sized after
+/// its share of the hash, to buffer all the entries it writes between two sync
+/// points, see TranspositionTable::merge().
+
+class QSTable {
+
+public:
+  static const int DefaultBits = 14; // 1MB with 64 bytes clusters
+
+  QSTable() : sizeBits(0), mem(nullptr), table(nullptr) {}
+ ~QSTable() { std::free(mem); }
+  QSTable(const QSTable&) = delete;
+  QSTable& operator=(const QSTable&) = delete;
+
+  // Size 0 frees the table
+  void resize(int bits) {
+    if (bits == sizeBits)
+        return;
+
+    std::free(mem);
+    sizeBits = bits;
+    mem = bits ? std::calloc((size_t(1) << sizeBits) * sizeof(TTClusterLayout) + 63, 1) : nullptr;
+    table = (TTClusterLayout*)((uintptr_t(mem) + 63) & ~uintptr_t(63));
+  }
+
+  void clear() { if (mem) std::memset(table, 0, (size_t(1) << sizeBits) * sizeof(TTClusterLayout)); }
+  TTEntry* first_entry(const Key key) const { return &table[key >> (64 - sizeBits)].entry[0]; }
+
+private:
+  friend class TranspositionTable;
+
+  int sizeBits;
+  void* mem;
+  TTClusterLayout* table;
+};
+
+
+/// A TranspositionTable consists of any number of clusters, as many as fit in
+/// the requested size, and each cluster consists of ClusterSize number of TTEntry. Each non-empty entry
+/// contains information of exactly one position. The cluster layout is given
+/// by TTClusterLayout. Clusters never cross cache lines, this ensures best
+/// cache performance, as the cacheline is prefetched, as soon as possible.
 
 class TranspositionTable {
 
+  // How the pages of the table are spread over the NUMA nodes of the machine
+  enum NumaPolicy { NUMA_LOCAL, NUMA_FIRST_TOUCH, NUMA_INTERLEAVE };
+
   static const int CacheLineSize = 64;
-  static const int ClusterSize = 3;
+  static const int ClusterSize = TTClusterLayout::Size;
 
-  struct Cluster {
-    TTEntry entry[ClusterSize];
-    char padding[2]; // Align to a divisor of the cache line size
-  };
+  typedef TTClusterLayout Cluster;
 
   static_assert(CacheLineSize % sizeof(Cluster) == 0, "Cluster size incorrect");
 
 public:
-  TranspositionTable() { mbSize_last_used = 0;  mbSize_last_used = 0; }
- ~TranspositionTable() {}
-  void new_search() { generation8 += 4; } // Lower 2 bits are used by Bound
+  TranspositionTable() { mbSize_last_used = 0; memBacking = "none"; staleAge = NoStaleAge; }
+ ~TranspositionTable();
+  void new_search();
+  void new_game();
   uint8_t generation() const { return generation8; }
-  TTEntry* probe(const Key key, bool& found) const;
+  TTEntry* probe(const Key key, bool& found, TTEntry& ttData) const;
+  TTEntry* probe(const QSTable& qsTable, const Key key, bool& found, TTEntry& ttData) const;
+  TTEntry* probe_buffered(const QSTable& buffer, const Key key, bool& found, TTEntry& ttData) const;
+  void merge(const std::vector<QSTable*>& buffers, size_t slice, size_t slices);
   int hashfull() const;
   void resize(size_t mbSize);
   void clear();
+  void dump(std::ostream& os);
+  bool load(std::istream& is);
+  const char* backing() const { return memBacking; }
+  const char* layout() const { return TTLayoutName; }
+  bool shared() const { return !segment.empty(); }
 
-  // The lowest order bits of the key are used to get the index of the cluster
+  // The key is mapped onto [0, clusterCount) with a fixed-point multiplication,
+  // so that any cluster count can be used without a slow modulo.
   TTEntry* first_entry(const Key key) const {
-    return &table[(size_t)key & (clusterCount - 1)].entry[0];
+    return &table[mul_hi64(key, clusterCount)].entry[0];
   }
 
 private:
+  static const uint8_t NoStaleAge = 0xFF; // Greater than any age
+
+  TTEntry* probe(TTEntry* const tte, const Key key, bool& found, TTEntry& ttData) const;
+  size_t transfer(const Cluster* oldTable, size_t oldClusterCount);
+
+  // After new_game() the entries written before the new game started are
+  // stale: search treats them as empty until a probe meets and erases them.
+  bool stale(const TTEntry& e) const {
+    return ((259 + generation8 - e.genBound8()) & 0xFC) > staleAge.load(std::memory_order_relaxed);
+  }
+
+  // Due to our packed storage format for generation and its cyclic nature
+  // we add 259 (256 is the modulus plus 3 to keep the lowest two bound bits
+  // from affecting the result) to calculate the entry age correctly even
+  // after generation8 overflows into the next cycle.
+  int replace_value(const TTEntry& e) const {
+    return e.depth() - ((259 + generation8 - e.genBound8()) & 0xFC) * 2 * ONE_PLY;
+  }
+
   int64_t  mbSize_last_used;
   bool large_pages_used;
   size_t clusterCount;
   Cluster* table;
   void* mem;
+  size_t memSize;         // Length of the mapping, needed by munmap()
+  const char* memBacking; // Kind of pages backing the table, for reporting
+  std::string segment;    // Name of the shared memory segment, empty if private
+  int numaPolicy;
   uint8_t generation8; // Size must be not bigger than TTEntry::genBound8
+  uint8_t epoch8;      // Generation at the start of the current game
+  std::atomic<uint8_t> staleAge;
 };
 
 extern TranspositionTable TT;
@@ -11,6 +11,7 @@
 #include <sstream>
 #include <string>
 
+#include "checkpoint.h"
 #include "evaluation.h"
 #include "movegenerator.h"
 #include "positioning.h"
@@ -21,7 +22,8 @@
 
 using namespace std;
 
-extern void benchmark(const Position& pos, istream& is);
+extern TimePoint benchmark(const Position& pos, istream& is);
+extern void scaling_benchmark(const Position& pos, istream& is);
 
 namespace {
 
@@ -174,19 +176,74 @@ void UCI::loop(int argc, char* argv[]) {
 
       else if (token == "ucinewgame")
       {
-          Search::clear();
+          Search::clear(Options["Lazy Hash Clear"]);
           Time.availableNodes = 0;
       }
       else if (token == "isready")    sync_cout << "readyok" << sync_endl;
       else if (token == "go")         go(pos, is);
       else if (token == "position")   position(pos, is);
       else if (token == "setoption")  setoption(is);
+      else if (token == "stats")
+      {
+          for (Thread* th : Threads)
+              sync_cout << "info string thread " << th->idx
+                        << " wake latency " << th->wakeLatency << " us"
+                        << " go latency " << th->goLatency << " us" << sync_endl;
+
+#ifdef SEARCH_STATS
+          sync_cout << Threads.prune_stats() << sync_endl;
+#else
+          sync_cout << "info string Search statistics need 'make searchstats=yes'" << sync_endl;
+#endif
+      }
+      else if (token == "checkpoint" || token == "restore")
+      {
+          string fileName;
+          getline(is >> ws, fileName);
+
+          if (Threads.main()->is_searching())
+              sync_cout << "info string Stop the search before " << token << sync_endl;
+
+          else if (fileName.empty())
+              sync_cout << "info string Missing file name" << sync_endl;
+
+          else
+          {
+              TimePoint elapsed = now();
+              bool ok = token == "checkpoint" ? Checkpoint::save(fileName)
+                                              : Checkpoint::restore(fileName);
+
+              sync_cout << "info string " << (token == "checkpoint" ? "Checkpoint " : "Restore ")
+                        << fileName << (ok ? " done in " : " failed after ")
+                        << now() - elapsed << " ms" << sync_endl;
+          }
+      }
 
       // Additional custom non-UCI commands, useful for debugging
       else if (token == "flip16953")       pos.flip();
       else if (token == "86640")       benchmark(pos, is);
+      else if (token == "pagebench16953")
+      {
+          // Run the same benchmark on default and on large pages, so that
+          // the two nps figures can be compared.
+          string args, largePages = Options["Large Pages"] ? "true" : "false";
+          getline(is, args);
+
+          for (string lp : { "false", "true" })
+          {
+              istringstream ss(args);
+              Options["Large Pages"] = lp;
+              benchmark(pos, ss);
+          }
+
+          Options["Large Pages"] = largePages;
+      }
+      else if (token == "scalebench16953") scaling_benchmark(pos, is);
       else if (token == "d16953")          sync_cout << pos << sync_endl;
       else if (token == "eval16953")       sync_cout << Eval::trace(pos) << sync_endl;
+      else if (token == "ttstats16953")    sync_cout << Threads.tt_stats()
+                                                     << "\nTT hashfull     : " << TT.hashfull()
+                                                     << " permill" << sync_endl;
       else if (token == "perft16953")
       {
           int depth;
@@ -10,6 +10,7 @@
 #include <algorithm>
 #include <cassert>
 #include <ostream>
+#include <sstream>
 
 
 #include <thread>
@@ -30,9 +31,13 @@ namespace UCI {
 /// 'On change' actions, triggered by an option's value change
 void on_clear_hash(const Option&) { Search::clear(); }
 void on_hash_size(const Option& o) { TT.resize(o); }
-void on_large_pages(const Option& o) { TT.resize(o); }  // warning is ok, will be removed
+void on_large_pages(const Option&) { TT.resize(0); } // Keep the current size
+void on_numa_policy(const Option&) { TT.resize(0); }
+void on_hash_segment(const Option&) { TT.resize(0); }
 void on_logger(const Option& o) { start_logger(o); }
 void on_threads(const Option&) { Threads.read_uci_options(); }
+void on_idle_spin(const Option&) { Threads.read_uci_options(); }
+void on_qsearch_hash(const Option&) { Threads.read_uci_options(); }
 void on_tb_path(const Option& o) { Tablebases::init(o); }
 
 
@@ -56,12 +61,20 @@ void init(OptionsMap& o) {
   o["Contempt"]              << Option(0, -100, 100);
   o["OwnBook"]               << Option(false);
   o["Threads"]               << Option(n, 1, 128, on_threads);
+  o["Idle Spin"]             << Option(2000, 0, 100000, on_idle_spin);
   o["Hash"]                  << Option(128, 1, MaxHashMB, on_hash_size);
   o["Large Pages"]           << Option(true, on_large_pages);
+  o["NUMA Policy"]           << Option("FirstTouch var Local var FirstTouch var Interleave", "FirstTouch", on_numa_policy);
+  o["Hash Segment"]          << Option("<empty>", on_hash_segment);
   o["Clear Hash"]            << Option(on_clear_hash);
+  o["Lazy Hash Clear"]       << Option(false);
+  o["QSearch Hash"]          << Option(false, on_qsearch_hash);
+  o["Helper Skip Rate"]      << Option(50, 0, 75);
+  o["Deterministic SMP"]     << Option(false);
   o["Best Book Move"]        << Option(false);
   o["Ponder"]                << Option(false);
   o["MultiPV"]               << Option(1, 1, 500);
+  o["MultiPV Split"]         << Option(false);
   o["Book File"]             << Option("book.bin");
   o["UCI_Chess960"]          << Option(false);
   o["SyzygyPath"]            << Option("<empty>", on_tb_path);
@@ -104,6 +117,9 @@ Option::Option(bool v, OnChange f) : type("check"), min(0), max(0), on_change(f)
 Option::Option(OnChange f) : type("button"), min(0), max(0), on_change(f)
 {}
 
+Option::Option(const char* v, const char* cur, OnChange f) : type("combo"), min(0), max(0), on_change(f)
+{ defaultValue = v; currentValue = cur; }
+
 Option::Option(int v, int minv, int maxv, OnChange f) : type("spin"), min(minv), max(maxv), on_change(f)
 { defaultValue = currentValue = std::to_string(v); }
 
@@ -117,6 +133,12 @@ Option::operator std::string() const {
   return currentValue;
 }
 
+bool Option::operator==(const char* s) const {
+  assert(type == "combo");
+  return    !CaseInsensitiveLess()(currentValue, s)
+         && !CaseInsensitiveLess()(s, currentValue);
+}
+
 
 /// operator<<() inits options and assigns idx in the correct printing order
 
@@ -142,6 +164,18 @@ Option& Option::operator=(const string& v) {
       || (type == "spin" && (stoi(v) < min || stoi(v) > max)))
       return *this;
 
+  // A combo value must be one of the 'var' alternatives listed in defaultValue
+  if (type == "combo")
+  {
+      OptionsMap comboMap; // To have case insensitive compare
+      string token;
+      std::istringstream ss(defaultValue);
+      while (ss >> token)
+          comboMap[token] << Option();
+      if (!comboMap.count(v) || v == "var")
+          return *this;
+  }
+
   if (type != "button")
       currentValue = v;
 